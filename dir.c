@@ -41,7 +41,7 @@ int uvfs_create(struct inode* dir,
     dprintk("<1>Entered uvfs_create: name=%s pid=%d\n", entry->d_name.name,
             current->pid);
 
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(dir->i_sb, UVFS_CREATE);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -84,7 +84,7 @@ out:
                 inode->i_ino,
                 current->pid);
     }
-    kfree(trans);
+    uvfs_free_transaction(trans);
     return retval;
 }
 
@@ -102,7 +102,7 @@ int uvfs_lookup_by_name(struct inode* dir, struct qstr* filename, uvfs_fhandle_s
         return -ENAMETOOLONG;
     }
 
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(dir->i_sb, UVFS_LOOKUP);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -123,7 +123,7 @@ int uvfs_lookup_by_name(struct inode* dir, struct qstr* filename, uvfs_fhandle_s
     *attr = reply->a;
     retval = reply->error;
 
-    kfree(trans);
+    uvfs_free_transaction(trans);
     return retval;
 }
 
@@ -198,7 +198,7 @@ int uvfs_unlink(struct inode* dir, struct dentry* entry)
         return -ENAMETOOLONG;
     }
 
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(dir->i_sb, UVFS_UNLINK);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -225,7 +225,7 @@ int uvfs_unlink(struct inode* dir, struct dentry* entry)
                 entry->d_name.name);
     }
 
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exited uvfs_unlink. %d\n", error);
     return error;
 }
@@ -257,7 +257,7 @@ int uvfs_symlink(struct inode* dir,
         return -ENAMETOOLONG;
     }
 
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(dir->i_sb, UVFS_SYMLINK);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -265,14 +265,29 @@ int uvfs_symlink(struct inode* dir,
     request = &trans->u.request.symlink;
     request->type = UVFS_SYMLINK;
     request->serial = trans->serial;
-    request->size = sizeof(*request);
     request->uid = current_fsuid();
     request->gid = (dir->i_mode & S_ISGID) ? dir->i_gid : current_fsgid();
     request->fh = UVFS_I(dir)->fh;
-    memcpy(request->name, entry->d_name.name, entry->d_name.len);
-    request->namelen = entry->d_name.len;
-    memcpy(request->sympath, path, pathlen);
-    request->symlen = pathlen;
+    if (uvfs_channel_features(trans->channel) & UVFS_FEATURE_COMPACT)
+    {
+        /* the header is the same, the name and path go at the end */
+        uvfs_symlink_compact_req_s* compact;
+        compact = &trans->u.request.symlink_compact;
+        compact->namelen = entry->d_name.len;
+        compact->symlen = pathlen;
+        memcpy(compact->data, entry->d_name.name, entry->d_name.len);
+        memcpy(compact->data + entry->d_name.len, path, pathlen);
+        compact->size = offsetof(uvfs_symlink_compact_req_s, data) +
+                        entry->d_name.len + pathlen;
+    }
+    else
+    {
+        request->size = sizeof(*request);
+        memcpy(request->name, entry->d_name.name, entry->d_name.len);
+        request->namelen = entry->d_name.len;
+        memcpy(request->sympath, path, pathlen);
+        request->symlen = pathlen;
+    }
     uvfs_make_request(trans);
 
     reply = &trans->u.reply.symlink;
@@ -295,7 +310,7 @@ int uvfs_symlink(struct inode* dir,
     dprintk("<1>Exiting uvfs_symlink 0x%x %ld\n", (unsigned)inode, inode->i_ino);
 
 out:
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exited uvfs_symlink. %d\n", error);
     return error;
 }
@@ -321,7 +336,7 @@ int uvfs_mkdir(struct inode* dir,
         return -ENAMETOOLONG;
     }
 
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(dir->i_sb, UVFS_MKDIR);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -361,7 +376,7 @@ int uvfs_mkdir(struct inode* dir,
     dir->i_nlink++;
     dprintk("<1>Exited uvfs_mkdir 0x%x %ld\n", (unsigned)inode, inode->i_ino);
 out:
-    kfree(trans);
+    uvfs_free_transaction(trans);
     return error;
 }
 
@@ -383,7 +398,7 @@ int uvfs_rmdir(struct inode* dir, struct dentry* entry)
         return -ENAMETOOLONG;
     }
 
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(dir->i_sb, UVFS_RMDIR);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -410,7 +425,7 @@ int uvfs_rmdir(struct inode* dir, struct dentry* entry)
     /* translate an EREMOTE into an ENOTEMPTY for directory not empty */
     if (error == -EREMOTE)
         error = -ENOTEMPTY;
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exiting uvfs_rmdir: error = %d 0x%x %ld\n", error,
             (unsigned)entry->d_inode, entry->d_inode->i_ino);
     return error;
@@ -437,7 +452,7 @@ int uvfs_rename(struct inode* srcdir,
     {
         return -ENAMETOOLONG;
     }
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(srcdir->i_sb, UVFS_RENAME);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -445,15 +460,34 @@ int uvfs_rename(struct inode* srcdir,
     request = &trans->u.request.rename;
     request->type = UVFS_RENAME;
     request->serial = trans->serial;
-    request->size = sizeof(*request);
     request->uid = current_fsuid();
     request->gid = current_fsgid();
     request->fh_old = UVFS_I(srcdir)->fh;
-    memcpy(request->old_name, srcentry->d_name.name, srcentry->d_name.len);
-    request->old_namelen = srcentry->d_name.len;
-    request->fh_new = UVFS_I(dstdir)->fh;
-    memcpy(request->new_name, dstentry->d_name.name, dstentry->d_name.len);
-    request->new_namelen = dstentry->d_name.len;
+    if (uvfs_channel_features(trans->channel) & UVFS_FEATURE_COMPACT)
+    {
+        /* both handles up front, both names at the end */
+        uvfs_rename_compact_req_s* compact;
+        compact = &trans->u.request.rename_compact;
+        compact->fh_new = UVFS_I(dstdir)->fh;
+        compact->old_namelen = srcentry->d_name.len;
+        compact->new_namelen = dstentry->d_name.len;
+        memcpy(compact->data, srcentry->d_name.name, srcentry->d_name.len);
+        memcpy(compact->data + srcentry->d_name.len,
+               dstentry->d_name.name, dstentry->d_name.len);
+        compact->size = offsetof(uvfs_rename_compact_req_s, data) +
+                        srcentry->d_name.len + dstentry->d_name.len;
+    }
+    else
+    {
+        request->size = sizeof(*request);
+        memcpy(request->old_name, srcentry->d_name.name,
+               srcentry->d_name.len);
+        request->old_namelen = srcentry->d_name.len;
+        request->fh_new = UVFS_I(dstdir)->fh;
+        memcpy(request->new_name, dstentry->d_name.name,
+               dstentry->d_name.len);
+        request->new_namelen = dstentry->d_name.len;
+    }
     uvfs_make_request(trans);
 
     reply = &trans->u.reply.rename;
@@ -480,7 +514,7 @@ int uvfs_rename(struct inode* srcdir,
         }
     }
 
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exited uvfs_rename\n");
     return error;
 }
@@ -504,7 +538,7 @@ int uvfs_readdir(struct file* filp,
     {
         int i;
         uvfs_dirent_s* ent;
-        trans = uvfs_new_transaction();
+        trans = uvfs_new_transaction(dir->i_sb, UVFS_READDIR);
         if (trans == NULL)
         {
             return -ENOMEM;
@@ -523,7 +557,7 @@ int uvfs_readdir(struct file* filp,
         if (reply->error < 0)
         {
             int error = reply->error;
-            kfree(trans);
+            uvfs_free_transaction(trans);
             return error;
         }
         if (reply->count == 0)
@@ -550,10 +584,10 @@ int uvfs_readdir(struct file* filp,
                                     ent->length +
                                     3) & ~3);
         }
-        kfree(trans);
+        uvfs_free_transaction(trans);
     }
 full:
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exited uvfs_readdir\n");
     return 0;
 }
@@ -655,7 +689,7 @@ int uvfs_permission(struct inode *inode, int mask, struct nameidata *nd)
 
     if (current_fsuid() != UVFS_I(inode)->attr_uid)
     {
-        trans = uvfs_new_transaction();
+        trans = uvfs_new_transaction(inode->i_sb, UVFS_GETATTR);
         if (trans == NULL)
         {
             return -ENOMEM;
@@ -673,12 +707,12 @@ int uvfs_permission(struct inode *inode, int mask, struct nameidata *nd)
         error = reply->error;
         if (error)
         {
-            kfree(trans);
+            uvfs_free_transaction(trans);
             return error;
         }
         i_mode = reply->a.i_mode;
         mode = reply->a.i_mode;
-        kfree(trans);
+        uvfs_free_transaction(trans);
     }
 
     if (current_fsuid() == inode->i_uid)
@@ -21,16 +21,52 @@
 
 #include <linux/module.h>
 #include <linux/proc_fs.h>
+#include <linux/poll.h>
+#include <linux/vmalloc.h>
+#include <linux/jhash.h>
+#include <asm/div64.h>
 #include "uvfs.h"
 
-/* Allow these signals to interrupt a request in progress */
-#define ALLOWED_SIGS   (sigmask(SIGKILL))
-
 static int uvfsd_open(struct inode *, struct file *);
 static int uvfsd_release(struct inode *, struct file *);
 static ssize_t uvfsd_read(struct file *, char *, size_t, loff_t *);
 static ssize_t uvfsd_write(struct file *, const char *, size_t, loff_t *);
 static int uvfsd_ioctl(struct inode *, struct file *, unsigned int, unsigned long);
+static int uvfsd_mmap(struct file *, struct vm_area_struct *);
+static unsigned int uvfsd_poll(struct file *, poll_table *);
+
+/*
+ * number of cpus sharing one request shard; the shard count is
+ * derived from this at load time
+ */
+static int cpus_per_shard = 1;
+module_param(cpus_per_shard, int, 0444);
+MODULE_PARM_DESC(cpus_per_shard, "Number of CPUs sharing one request queue");
+
+/*
+ * milliseconds a queued request of a lower priority class may be passed
+ * over by higher ones before it is served ahead of them
+ */
+static int prio_age_ms = 200;
+module_param(prio_age_ms, int, 0644);
+MODULE_PARM_DESC(prio_age_ms, "Queue wait after which a low priority request is served first");
+
+/*
+ * seconds a request waits for its reply before it fails with -ETIMEDOUT,
+ * indexed by request type; 0 waits forever
+ */
+static int op_timeout[UVFS_COMPOUND + 1];
+module_param_array(op_timeout, int, NULL, 0644);
+MODULE_PARM_DESC(op_timeout, "Per request type reply deadline in seconds, 0 for none");
+
+/*
+ * seconds without any reply on a channel with requests pending after
+ * which the daemon is declared stuck, and everything pending fails
+ * with -EIO; 0 disables the watchdog
+ */
+static int watchdog_secs = 0;
+module_param(watchdog_secs, int, 0644);
+MODULE_PARM_DESC(watchdog_secs, "Fail requests after this many seconds without replies, 0 for never");
 
 /*
  * file operations defined for the pmfs
@@ -44,22 +80,160 @@ struct file_operations Uvfsd_file_operations =
     .read           = uvfsd_read,
     .write          = uvfsd_write,
     .ioctl          = uvfsd_ioctl,
+    .mmap           = uvfsd_mmap,
+    .poll           = uvfsd_poll,
 };
 
 static struct proc_dir_entry* uvfs_proc_file;
 
-static wait_queue_head_t Uvfs_driver_queue;
-static spinlock_t Uvfs_lock;
+/*
+ * Requests are queued on a shard chosen by the cpu of the caller, so
+ * filesystem threads on different cpus don't contend for one lock and
+ * one list.  Each daemon fd sleeps on its own shard and steals from
+ * the others when its shard is empty.
+ *
+ * Lock order is shard->lock, then channel->lock.
+ */
+#define UVFS_MAX_SHARDS 64
+
+/*
+ * Request and reply rings shared with a daemon fd through mmap.  The
+ * module produces requests at sq_tail and the daemon consumes them at
+ * sq_head; the daemon produces replies at cq_tail and the module
+ * consumes them at cq_head when the daemon calls UVFS_IOCTL_RING_ENTER.
+ */
+#define UVFS_RING_MAX_SLOT (64 * 1024)
+
+typedef struct _uvfs_ring_s
+{
+    spinlock_t sq_lock;             /* serializes request producers */
+    struct mutex cq_mutex;          /* serializes reply consumers */
+    uvfs_channel_s* channel;
+    uvfs_ring_hdr_s* hdr;
+    char* sq;
+    char* cq;
+    unsigned entries;
+    unsigned slot_size;
+    unsigned long mmap_size;
+    wait_queue_head_t wait;         /* the owner, woken by direct posts */
+} uvfs_ring_s;
+
+typedef struct _uvfs_shard_s
+{
+    spinlock_t lock;
+    struct list_head requests[UVFS_NR_PRIOS];
+    int queued;                     /* on all of the requests lists */
+    wait_queue_head_t driver_queue;
+    uvfs_ring_s* ring;              /* ring requests are posted to directly */
+    /* queue wait of dequeued requests, in jiffies */
+    unsigned long long wait_total[UVFS_NR_PRIOS];
+    unsigned long wait_max[UVFS_NR_PRIOS];
+    unsigned long wait_count[UVFS_NR_PRIOS];
+} ____cacheline_aligned_in_smp uvfs_shard_s;
+
+static int Uvfs_nr_shards = 1;
+
+/*
+ * transactions handed to the daemon and waiting for a reply,
+ * hashed by serial number so a reply can be matched without
+ * walking every outstanding request
+ */
+#define UVFS_REPLY_HASH_BITS 8
+#define UVFS_REPLY_HASH_SIZE (1 << UVFS_REPLY_HASH_BITS)
+
+/*
+ * sent GETATTR and LOOKUP requests that identical later requests can
+ * wait on instead of asking again, hashed by their contents
+ */
+#define UVFS_COALESCE_HASH_BITS 6
+#define UVFS_COALESCE_HASH_SIZE (1 << UVFS_COALESCE_HASH_BITS)
+
+/*
+ * Channels have their own queues, serial numbers and shutdown state,
+ * so one slow store doesn't hold up the mounts of the others.
+ *
+ * The request path takes a shard lock to queue or dequeue and
+ * reply_lock for the in-flight table, always in that order.  lock only
+ * covers the rarely changed state of the channel and is never held
+ * together with either.
+ */
+struct _uvfs_channel_s
+{
+    spinlock_t lock;                /* protects the fields below */
+    int id;
+    int shutting_down;
+    int mounts;                     /* superblocks using this channel */
+    int cancel;                     /* daemon enabled UVFS_FEATURE_CANCEL */
+    int stalled;                    /* watchdog fired, fail new requests */
+    unsigned long last_progress;    /* jiffies of the last reply, no lock */
+    /* negotiated with UVFS_IOCTL_HELLO, see uvfs_channel_hello */
+    int hello;                      /* some daemon fd said hello */
+    int legacy;                     /* reading fds that never said hello */
+    unsigned version;
+    unsigned features;              /* enabled by every daemon fd */
+    unsigned max_read;
+    unsigned max_write;
+    unsigned max_readdir;
+    unsigned slot_size;             /* smallest ring slot, 0 for no ring */
+    atomic_t serial_number;
+    atomic_t use_count;             /* daemon fds serving this channel */
+    atomic_t pending;               /* requests waiting for a reply */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+    struct delayed_work tick;       /* uvfs_channel_tick while pending */
+#else
+    struct work_struct tick;
+#endif
+    /* protects the fields below and the in_use/abort handshake */
+    spinlock_t reply_lock;
+    unsigned long coalesced;        /* requests answered by another's reply */
+    struct hlist_head leaders[UVFS_COALESCE_HASH_SIZE];
+    struct hlist_head replies[UVFS_REPLY_HASH_SIZE];
+    uvfs_shard_s shards[0];         /* Uvfs_nr_shards of them */
+};
+
+static uvfs_channel_s* Uvfs_channels[UVFS_MAX_CHANNELS];
+
+/* per open state of the pmfs device */
+typedef struct _uvfsd_file_s
+{
+    spinlock_t lock;                /* orders channel against started */
+    uvfs_channel_s* channel;        /* set by UVFS_IOCTL_CHANNEL */
+    int started;                    /* has served channel, it is fixed */
+    int hello;                      /* said hello, under channel lock */
+    int legacy;                     /* read without hello, counted */
+    int shard;                      /* home request shard */
+    unsigned features;              /* UVFS_FEATURE_* enabled on this fd */
+    uvfs_ring_s* ring;              /* set up by UVFS_IOCTL_RING_SETUP */
+} uvfsd_file_s;
+
+static int uvfs_ring_requests(uvfs_ring_s *);
+static void uvfs_ring_destroy(uvfsd_file_s *);
+static uvfs_transaction_s* uvfs_alloc_transaction(uvfs_channel_s *, int,
+                                                  unsigned);
+
+#define CREATE_TRACE_POINTS
+#include "uvfs_trace.h"
+
+#define UVFS_SUPPORTED_FEATURES (UVFS_FEATURE_BATCH_READ | \
+                                 UVFS_FEATURE_BATCH_WRITE | \
+                                 UVFS_FEATURE_CANCEL | \
+                                 UVFS_FEATURE_COMPACT | \
+                                 UVFS_FEATURE_COMPOUND)
 
-static int ShuttingDown = 0;
-static int Serial_number = 0;
+/* features that change what requests look like, only enabled by HELLO */
+#define UVFS_LAYOUT_FEATURES (UVFS_FEATURE_COMPACT | UVFS_FEATURE_COMPOUND)
 
-static int uvfs_use_count = 0;
+/* the most data the fixed request and reply layouts carry */
+#define UVFS_FIXED_MAX_READ PAGE_CACHE_SIZE
+#define UVFS_FIXED_MAX_WRITE PAGE_CACHE_SIZE
+#define UVFS_FIXED_MAX_READDIR UVFS_BUFFSIZE
 
-LIST_HEAD(Uvfs_requests);
-LIST_HEAD(Uvfs_replies);
+/* the most the module handles with daemons that said hello */
+#define UVFS_MODULE_MAX_READ (UVFS_MAX_READ_PAGES << PAGE_CACHE_SHIFT)
+#define UVFS_MODULE_MAX_WRITE (UVFS_MAX_WRITE_PAGES << PAGE_CACHE_SHIFT)
+#define UVFS_MODULE_MAX_READDIR UVFS_FIXED_MAX_READDIR
 
-static char* Op_names[] =
+char* Op_names[] =
 {
     "NULL",
     "write",
@@ -78,374 +252,2492 @@ static char* Op_names[] =
     "read_super",
     "readlink",
     "shutdown",
+    "cancel",
+    "compound",
     "LAST + 1"
 };
 
+static char* Prio_names[] =
+{
+    "metadata",
+    "data",
+    "background",
+};
 
-/*
- * open the driver for access by server file system thread
- * driver can be opened muliple times by different threads
- */
-static int uvfsd_open(struct inode* inode, struct file* file)
+
+static inline struct hlist_head* uvfs_reply_bucket(uvfs_channel_s* chan,
+                                                   int serial)
+{
+    /* serial numbers are handed out sequentially, so the low bits spread well */
+    return &chan->replies[serial & (UVFS_REPLY_HASH_SIZE - 1)];
+}
+
+
+/* Find the in-flight transaction for a reply.  Called with reply_lock held. */
+
+static uvfs_transaction_s* uvfs_find_reply(uvfs_channel_s* chan, int serial)
+{
+    uvfs_transaction_s* trans;
+    struct hlist_node* node;
+
+    hlist_for_each_entry(trans, node, uvfs_reply_bucket(chan, serial), hash)
+    {
+        if (trans->serial == serial)
+            return trans;
+    }
+    return NULL;
+}
+
+
+static inline int uvfs_cpu_shard(int cpu)
+{
+    return (cpu / cpus_per_shard) % Uvfs_nr_shards;
+}
+
+
+/* Any request waiting on any shard?  Used without locks to decide to sleep. */
+
+static int uvfs_requests_pending(uvfs_channel_s* chan)
 {
-    spin_lock(&Uvfs_lock);
-    uvfs_use_count++;
-    spin_unlock(&Uvfs_lock);
+    int i;
+    for (i = 0; i < Uvfs_nr_shards; i++)
+    {
+        if (ACCESS_ONCE(chan->shards[i].queued))
+            return 1;
+    }
     return 0;
 }
 
 
 /*
- * close the driver from file system thread
- * each thread must close the connection to unload driver
+ * Wake a daemon thread for a request queued on shard.  Prefer the
+ * threads sleeping on that shard, otherwise any idle thread will steal it.
  */
-static int uvfsd_release(struct inode* inode, struct file* filp)
+static void uvfs_wake_daemon(uvfs_channel_s* chan, int shard)
 {
-    spin_lock(&Uvfs_lock);
-    uvfs_use_count--;
-    if (uvfs_use_count == 0)
+    int i;
+
+    smp_mb();
+    for (i = 0; i < Uvfs_nr_shards; i++)
     {
-        uvfs_transaction_s* trans;
-        while (!list_empty(&Uvfs_requests))
+        uvfs_shard_s* s = &chan->shards[(shard + i) % Uvfs_nr_shards];
+        if (waitqueue_active(&s->driver_queue))
         {
-            trans = list_entry(Uvfs_requests.next, uvfs_transaction_s, list);
-            list_del_init(&trans->list);
-            trans->u.reply.generic.error = -EIO;
-            trans->answered = 1;
-            wake_up(&trans->fs_queue);
-        }
-        while (!list_empty(&Uvfs_replies))
-        {
-            trans = list_entry(Uvfs_replies.next, uvfs_transaction_s, list);
-            list_del_init(&trans->list);
-            trans->u.reply.generic.error = -EIO;
-            trans->answered = 1;
-            wake_up(&trans->fs_queue);
+            wake_up_interruptible(&s->driver_queue);
+            return;
         }
-        ShuttingDown = 0;
-        Serial_number = 0;
     }
-    spin_unlock(&Uvfs_lock);
-    return 0;
 }
 
 
-/* Reads are user space queries for fs request. */
+static void uvfs_wake_all_daemons(uvfs_channel_s* chan)
+{
+    int i;
+    for (i = 0; i < Uvfs_nr_shards; i++)
+        wake_up_interruptible(&chan->shards[i].driver_queue);
+}
 
-static ssize_t uvfsd_read(struct file* filp,
-                          char* buff,
-                          size_t count,
-                          loff_t* offset)
+
+/*
+ * Pick the next request of at most max_size bytes to serve from shard:
+ * the oldest of the highest priority class, unless the oldest of a lower
+ * class has waited longer than prio_age_ms.  Larger requests are left
+ * for a reader with room for them rather than holding up the ones
+ * behind.  Called with shard->lock held.
+ */
+static uvfs_transaction_s* uvfs_next_request(uvfs_shard_s* shard,
+                                             size_t max_size)
 {
-    int ret = 0;
     uvfs_transaction_s* trans;
-    uvfs_generic_req_s* request;
-    dprintk("<1>Entered uvfsd_read (%d)\n", current->pid);
+    uvfs_transaction_s* next = NULL;
+    unsigned long age = msecs_to_jiffies(prio_age_ms);
+    int prio;
+    int found;
 
-    /* Check for bogus count. */
-    if (count < sizeof(uvfs_request_u))
-    {
-        dprintk("<1>uvfsd_read EIO (%d)(%d)\n", count, sizeof(uvfs_request_u));
-        return -EIO;
-    }
-    /* Grab the lock */
-    spin_lock(&Uvfs_lock);
-    /* Wait for a request */
-    while (list_empty(&Uvfs_requests) || ShuttingDown)
+    for (prio = 0; prio < UVFS_NR_PRIOS; prio++)
     {
-        wait_queue_t wait;
-        if (ShuttingDown)
+        found = 0;
+        list_for_each_entry(trans, &shard->requests[prio], list)
         {
-            uvfs_shutdown_req_s req;
-            int size;
-            spin_unlock(&Uvfs_lock);
-            req.type = UVFS_SHUTDOWN;
-            size = req.size = sizeof(req);
-            ret = copy_to_user(buff, &req, req.size);
-            spin_lock(&Uvfs_lock);
-            wake_up_interruptible(&Uvfs_driver_queue);
-            spin_unlock(&Uvfs_lock);
-            if(ret)
-                return -EIO;
-            else
-                return size;
+            if (trans->u.request.generic.size <= max_size)
+            {
+                found = 1;
+                break;
+            }
         }
-        dprintk("<1>uvfsd_read: About to sleep for request\n");
-        init_waitqueue_entry(&wait, current);
-        add_wait_queue_exclusive(&Uvfs_driver_queue, &wait);
-        dprintk("<1>uvfsd_read: add_wait_queue_exclusive\n");
-        set_current_state(TASK_INTERRUPTIBLE);
-        spin_unlock(&Uvfs_lock);
-        schedule();
-        spin_lock(&Uvfs_lock);
-        dprintk("<1>uvfsd_read: set_current_state\n");
-        set_current_state(TASK_RUNNING);
-        remove_wait_queue(&Uvfs_driver_queue, &wait);
-        if (signal_pending(current))
-        {
-            spin_unlock(&Uvfs_lock);
-            dprintk("<1>Exited uvfsd_read: ERESTARTSYS\n");
-            return -ERESTARTSYS;
-        }
-    }
-    /* There is a request ready. */
-    trans = list_entry(Uvfs_requests.next, uvfs_transaction_s, list);
-    list_del_init(&trans->list);
-    list_add_tail(&trans->list, &Uvfs_replies);
-    /*
-       This may be overkill but I can't prove to myself that
-       there isn't a possibility of a request going unanswered.
-    */
-    wake_up_interruptible(&Uvfs_driver_queue);
-    trans->in_use = 1;
-    spin_unlock(&Uvfs_lock);
-    request = &trans->u.request.generic;
-    ret = copy_to_user(buff, request, request->size);
-    spin_lock(&Uvfs_lock);
-    trans->in_use = 0;
-    if (trans->abort)
-        wake_up(&trans->fs_queue);
-    spin_unlock(&Uvfs_lock);
-    dprintk("<1>Exited uvfsd_read: %d (%d)\n",
-            request->size,
-            current->pid);
-    if(ret)
-        return -EIO;
-    else
-        return request->size;
+        if (!found)
+            continue;
+        if (next == NULL)
+            next = trans;
+        else if (time_after(jiffies, trans->queued + age))
+            return trans;
+    }
+    return next;
 }
 
 
-/* Writes are replies from the user space filesystem implementation. */
-
-static ssize_t uvfsd_write(struct file* file,
-                           const char* buff,
-                           size_t count,
-                           loff_t* offset)
+/*
+ * Take the next request that fits max_size off shard and move it to the
+ * in-flight table, marked in use for the copy to user space.  Returns
+ * NULL if no queued request fits.
+ */
+static uvfs_transaction_s* uvfs_dequeue_shard(uvfs_channel_s* chan,
+                                              uvfs_shard_s* shard,
+                                              size_t max_size)
 {
-    int ret = 0;
-    uvfs_generic_rep_s reply;
-    struct list_head* ptr;
     uvfs_transaction_s* trans = NULL;
-    if (count < sizeof(uvfs_generic_rep_s))
-    {
-        dprintk("<1>uvfsd_write Undersized reply (%d).\n", count);
-        return -EIO;
-    }
-    if (copy_from_user(&reply, buff, sizeof(reply)))
-    {
-        dprintk("<1>copy_from_user failed in uvfsd_write.\n");
-        return -EFAULT;
-    }
-    dprintk("<1>Entered uvfsd_write: serial=%d (%d)\n",
-            reply.serial,
-            current->pid);
-    if (reply.size != count)
-    {
-        dprintk("<1>Mismatched write size in uvfsd_write %d %d\n",
-               reply.size, count);
-        return -EINVAL;
-    }
-    spin_lock(&Uvfs_lock);
-    dprintk("<1>uvfsd_write: Looking for transaction serial=%d\n",
-            reply.serial);
-    for (ptr = Uvfs_replies.next; ptr != &Uvfs_replies; ptr = ptr->next)
+    unsigned long wait;
+
+    if (!ACCESS_ONCE(shard->queued))
+        return NULL;
+    spin_lock(&shard->lock);
+    if (shard->queued)
     {
-        trans = list_entry(ptr, uvfs_transaction_s, list);
-        if (trans->serial == reply.serial)
+        trans = uvfs_next_request(shard, max_size);
+        if (trans == NULL)
         {
-            dprintk("<1>uvfsd_write: found transaction\n");
-            break;
+            spin_unlock(&shard->lock);
+            return NULL;
         }
-        trans = NULL;
-    }
-    if (trans == NULL)
-    {
-        dprintk("<1>uvfsd_write: invalid reply %d\n", reply.serial);
-        spin_unlock(&Uvfs_lock);
-        return -EINVAL;
+        list_del_init(&trans->list);
+        shard->queued--;
+        trans->t_dequeued = uvfs_clock();
+        trace_uvfs_dequeue(trans);
+        wait = jiffies - trans->queued;
+        shard->wait_total[trans->prio] += wait;
+        shard->wait_count[trans->prio]++;
+        if (wait > shard->wait_max[trans->prio])
+            shard->wait_max[trans->prio] = wait;
+        set_bit(UVFS_TRANS_IN_USE, &trans->state);
+        if (!trans->noreply)
+        {
+            spin_lock(&chan->reply_lock);
+            hlist_add_head(&trans->hash, uvfs_reply_bucket(chan, trans->serial));
+            spin_unlock(&chan->reply_lock);
+        }
+        /*
+           This may be overkill but I can't prove to myself that
+           there isn't a possibility of a request going unanswered.
+        */
+        if (shard->queued)
+            wake_up_interruptible(&shard->driver_queue);
     }
-    /* We have a transaction */
-    list_del_init(&trans->list);
-    trans->in_use = 1;
-    spin_unlock(&Uvfs_lock);
-    ret = copy_from_user(&trans->u.reply, buff, reply.size);
-    spin_lock(&Uvfs_lock);
-    trans->in_use = 0;
-    trans->answered = 1;
-    wake_up(&trans->fs_queue);
-    spin_unlock(&Uvfs_lock);
-    dprintk("<1>Exited uvfsd_write (%d)\n", current->pid);
-    if(ret)
-        return -EIO;
-    else
-        return reply.size;
+    spin_unlock(&shard->lock);
+    return trans;
 }
 
 
-/* Used to signal the user-space filesystem to shutdown, cmd = 0 */
+/* Dequeue from the home shard first, then steal from the others. */
 
-static int uvfsd_ioctl(struct inode* inode, struct file* filp,
-                       unsigned int cmd, unsigned long arg)
+static uvfs_transaction_s* uvfs_dequeue(uvfs_channel_s* chan,
+                                        int home,
+                                        size_t max_size)
 {
-    switch (cmd)
+    uvfs_transaction_s* trans;
+    int i;
+
+    for (i = 0; i < Uvfs_nr_shards; i++)
     {
-        case UVFS_IOCTL_SHUTDOWN:
-        {
-            dprintk("Entering uvfsd_ioctl SHUTDOWN\n");
-            spin_lock(&Uvfs_lock);
-            ShuttingDown = 1;
-            wake_up_interruptible(&Uvfs_driver_queue);
-            spin_unlock(&Uvfs_lock);
-            return 0;
-        }
-        case UVFS_IOCTL_STATUS:
-        {
-            struct list_head* ptr;
-            spin_lock(&Uvfs_lock);
-            printk("<1>Pending Requests:\n");
-            for (ptr = Uvfs_requests.next;
-                 ptr != &Uvfs_requests;
-                 ptr = ptr->next)
-            {
-                uvfs_transaction_s* trans =
-                    list_entry(ptr, uvfs_transaction_s, list);
-                printk("<1>SN: %d (%s)\n",
-                       trans->serial, Op_names[trans->u.request.generic.type]);
-            }
-            printk("<1>Pending replies:\n");
-            for (ptr = Uvfs_replies.next;
-                 ptr != &Uvfs_replies;
-                 ptr = ptr->next)
-            {
-                uvfs_transaction_s* trans =
-                    list_entry(ptr, uvfs_transaction_s, list);
-                printk("<1>SN: %d (%s)\n",
-                       trans->serial, Op_names[trans->u.request.generic.type]);
-            }
-            spin_unlock(&Uvfs_lock);
-            break;
-        }
-        case UVFS_IOCTL_MOUNT:
-        {
-            // make sure nothing is mounted
-            return !list_empty(&Uvfs_file_system_type.fs_supers);
-        }
-        case UVFS_IOCTL_USE_COUNT:
-        default:
-            // return number of opens active on this module
-            return uvfs_use_count;
+        trans = uvfs_dequeue_shard(chan,
+                                   &chan->shards[(home + i) % Uvfs_nr_shards],
+                                   max_size);
+        if (trans != NULL)
+            return trans;
     }
-    return 0;
+    return NULL;
 }
 
 
-int uvfs_make_request(uvfs_transaction_s* trans)
+/*
+ * The copy of a dequeued request is finished, let an aborting caller go.
+ * Nobody waits for a message that gets no reply, it is done with now.
+ */
+static void uvfs_clear_in_use(uvfs_transaction_s* trans)
 {
-    sigset_t oldset;
-    unsigned long irqflags;
+    uvfs_channel_s* chan = trans->channel;
 
-    /* Make sure the server is running, and add our request to the queue */
-    spin_lock(&Uvfs_lock);
-    if (uvfs_use_count == 0)
+    if (trans->noreply)
     {
-        trans->u.reply.generic.error = -EIO;
-        spin_unlock(&Uvfs_lock);
-        return 0;
+        uvfs_free_transaction(trans);
+        return;
     }
-    list_add_tail(&trans->list, &Uvfs_requests);
-    wake_up_interruptible(&Uvfs_driver_queue);
-    spin_unlock(&Uvfs_lock);
+    /* under reply_lock so an aborting caller can't free trans under us */
+    spin_lock(&chan->reply_lock);
+    clear_bit(UVFS_TRANS_IN_USE, &trans->state);
+    if (test_bit(UVFS_TRANS_ABORT, &trans->state))
+        wake_up(&trans->fs_queue);
+    spin_unlock(&chan->reply_lock);
+}
 
-    /* Mask all signals except ALLOWED_SIGS while we wait */
-    spin_lock_irqsave(&current->sighand->siglock, irqflags);
-    oldset = current->blocked;
-    siginitsetinv(&current->blocked, ALLOWED_SIGS & ~oldset.sig[0]);
-    recalc_sigpending();
-    spin_unlock_irqrestore(&current->sighand->siglock, irqflags);
 
-    /* Wait while the request is processed */
-    wait_event_interruptible(trans->fs_queue, trans->answered);
+/*
+ * The copy of a dequeued request to user space failed.  Put it back at
+ * the head of its shard so another daemon thread will pick it up.
+ */
+static void uvfs_requeue(uvfs_transaction_s* trans)
+{
+    uvfs_channel_s* chan = trans->channel;
+    int home = trans->shard;
+    uvfs_shard_s* shard = &chan->shards[home];
+
+    spin_lock(&shard->lock);
+    spin_lock(&chan->reply_lock);
+    hlist_del_init(&trans->hash);
+    trans->queued = jiffies;
+    trace_uvfs_requeue(trans);
+    list_add(&trans->list, &shard->requests[trans->prio]);
+    shard->queued++;
+    clear_bit(UVFS_TRANS_IN_USE, &trans->state);
+    if (test_bit(UVFS_TRANS_ABORT, &trans->state))
+        wake_up(&trans->fs_queue);
+    spin_unlock(&chan->reply_lock);
+    spin_unlock(&shard->lock);
+    /* trans may be answered, or freed by an aborting caller, by now */
+    uvfs_wake_daemon(chan, home);
+}
+
+
+/*
+ * Is there anything for this daemon fd to pick up?  Used without locks
+ * to decide whether to sleep.
+ */
+static int uvfs_daemon_has_work(uvfsd_file_s* dfile)
+{
+    uvfs_channel_s* chan = dfile->channel;
+
+    return chan->shutting_down || uvfs_requests_pending(chan) ||
+           (dfile->ring != NULL && uvfs_ring_requests(dfile->ring) > 0);
+}
 
-    /* Check to see if we were interrupted by a signal */
-    spin_lock(&Uvfs_lock);
+
+/*
+ * Sleep on the home shard of a daemon fd until there may be a request
+ * for it, or the channel is shutting down.  A fd with a ring also
+ * sleeps on the ring, for requests posted straight to it.  A fd opened
+ * with O_NONBLOCK gets -EAGAIN instead.
+ */
+static int uvfs_wait_for_request(struct file* filp)
+{
+    wait_queue_t wait;
+    wait_queue_t ring_wait;
+    uvfsd_file_s* dfile = filp->private_data;
+    uvfs_shard_s* home = &dfile->channel->shards[dfile->shard];
+
+    if (filp->f_flags & O_NONBLOCK)
+        return -EAGAIN;
+
+    dprintk("<1>uvfsd_read: About to sleep for request\n");
+    init_waitqueue_entry(&wait, current);
+    add_wait_queue_exclusive(&home->driver_queue, &wait);
+    if (dfile->ring != NULL)
+    {
+        init_waitqueue_entry(&ring_wait, current);
+        add_wait_queue(&dfile->ring->wait, &ring_wait);
+    }
+    dprintk("<1>uvfsd_read: add_wait_queue_exclusive\n");
+    set_current_state(TASK_INTERRUPTIBLE);
+    if (!uvfs_daemon_has_work(dfile))
+        schedule();
+    dprintk("<1>uvfsd_read: set_current_state\n");
+    set_current_state(TASK_RUNNING);
+    if (dfile->ring != NULL)
+        remove_wait_queue(&dfile->ring->wait, &ring_wait);
+    remove_wait_queue(&home->driver_queue, &wait);
     if (signal_pending(current))
     {
-        if (trans->in_use)
-        {
-            trans->abort = 1;
-            spin_unlock(&Uvfs_lock);
-            wait_event(trans->fs_queue, !trans->in_use);
-            spin_lock(&Uvfs_lock);
-        }
-        list_del_init(&trans->list);
-        trans->u.reply.generic.error = -ERESTARTSYS;
+        dprintk("<1>Exited uvfsd_read: ERESTARTSYS\n");
+        return -ERESTARTSYS;
     }
-    spin_unlock(&Uvfs_lock);
+    return 0;
+}
 
-    /* Restore the original signal mask */
-    spin_lock_irqsave(&current->sighand->siglock, irqflags);
-    current->blocked = oldset;
-    recalc_sigpending();
-    spin_unlock_irqrestore(&current->sighand->siglock, irqflags);
 
-    return 0;
+/* What a channel speaks until one of its daemon fds says hello. */
+
+static void uvfs_channel_defaults(uvfs_channel_s* chan)
+{
+    chan->hello = 0;
+    chan->version = 1;
+    chan->features = 0;
+    chan->max_read = UVFS_FIXED_MAX_READ;
+    chan->max_write = UVFS_FIXED_MAX_WRITE;
+    chan->max_readdir = UVFS_FIXED_MAX_READDIR;
+    chan->slot_size = 0;
 }
 
 
 /*
- * allocate a new tranaction request object and initialize it
- * this object will need to be freed after the request is completed
- *
+ * A READ reply comes back and a WRITE request goes out in a single ring
+ * slot, so keep max_read and max_write to whole pages that fit one with
+ * the header.  Slots are never smaller than a request or reply union,
+ * which carry a page.  Under chan->lock.
  */
-uvfs_transaction_s* uvfs_new_transaction(void)
+static void uvfs_channel_fit_slot(uvfs_channel_s* chan)
 {
-    uvfs_transaction_s* trans;
-    dprintk("Entering uvfs_new_transaction\n");
-    trans = kmalloc(sizeof(uvfs_transaction_s), GFP_NOFS);
-    if (trans == NULL)
-    {
-        dprintk("Exiting uvfs_new_transaction NULL\n");
-        return NULL;
-    }
-    spin_lock(&Uvfs_lock);
-    trans->serial = Serial_number++;
-    init_waitqueue_head(&trans->fs_queue);
-    INIT_LIST_HEAD(&trans->list);
-    trans->in_use = 0;
-    trans->abort = 0;
-    trans->answered = 0;
-    dprintk("Issued serial = %d\n", trans->serial);
-    spin_unlock(&Uvfs_lock);
-    dprintk("Exiting uvfs_new_transaction\n");
-    return trans;
+    unsigned max;
+
+    if (chan->slot_size == 0)
+        return;
+    max = chan->slot_size - offsetof(uvfs_file_read_rep_s, buff);
+    chan->max_read = min(chan->max_read, max & PAGE_CACHE_MASK);
+    max = chan->slot_size - offsetof(uvfs_file_write_req_s, buff);
+    chan->max_write = min(chan->max_write, max & PAGE_CACHE_MASK);
+}
+
+
+/* A daemon fd starts serving chan. */
+
+static void uvfs_channel_open(uvfs_channel_s* chan)
+{
+    atomic_inc(&chan->use_count);
 }
 
 
 /*
- * init pmfs driver, create /proc/fs/pmfs device node
- * and register the pmfs file system type.
- *
+ * Completion callbacks of asynchronous requests run here, in process
+ * context, rather than in the daemon thread that delivered the reply.
  */
-static int __init uvfs_init(void)
+static struct workqueue_struct* Uvfs_workqueue;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+static void uvfs_async_done(struct work_struct* work)
 {
-    int result;
-    spin_lock_init(&Uvfs_lock);
-    init_waitqueue_head(&Uvfs_driver_queue);
+    uvfs_transaction_s* trans = container_of(work, uvfs_transaction_s, work);
+#else
+static void uvfs_async_done(void* data)
+{
+    uvfs_transaction_s* trans = data;
+#endif
+    atomic_dec(&trans->channel->pending);
+    uvfs_stats_record(trans->type, trans);
+    trans->done(trans);
+}
 
-    dprintk("<1>uvfs_init(/proc/%s)\n", UVFS_PROC_NAME);
 
-    uvfs_proc_file = create_proc_entry(UVFS_PROC_NAME, S_IFREG | 0600, NULL);
-    if (uvfs_proc_file == NULL)
-    {
-        dprintk("<1>Could not create /proc/%s\n", UVFS_PROC_NAME);
-        return -EIO;
+/*
+ * The reply of trans, or the error in its place, is ready.  Wake the
+ * caller, or run the callback of an asynchronous request.  Called with
+ * reply_lock or the shard lock held.
+ */
+static void uvfs_answer(uvfs_transaction_s* trans)
+{
+    set_bit(UVFS_TRANS_ANSWERED, &trans->state);
+    trace_uvfs_wakeup(trans);
+    if (trans->done != NULL)
+        queue_work(Uvfs_workqueue, &trans->work);
+    else
+        wake_up(&trans->fs_queue);
+}
+
+
+/*
+ * Fail every request queued or in flight on chan with error.  Requests
+ * being copied to or from the daemon right now are left alone.
+ */
+static void uvfs_channel_fail(uvfs_channel_s* chan, int error)
+{
+    uvfs_transaction_s* trans;
+    uvfs_transaction_s* next;
+    struct hlist_node* node;
+    struct hlist_node* tmp;
+    int i, prio;
+
+    for (i = 0; i < Uvfs_nr_shards; i++)
+    {
+        uvfs_shard_s* shard = &chan->shards[i];
+        spin_lock(&shard->lock);
+        for (prio = 0; prio < UVFS_NR_PRIOS; prio++)
+        {
+            list_for_each_entry_safe(trans, next, &shard->requests[prio], list)
+            {
+                list_del_init(&trans->list);
+                shard->queued--;
+                if (trans->noreply)
+                {
+                    uvfs_free_transaction(trans);
+                    continue;
+                }
+                trans->u.reply.generic.error = error;
+                uvfs_answer(trans);
+            }
+        }
+        spin_unlock(&shard->lock);
+    }
+    spin_lock(&chan->reply_lock);
+    for (i = 0; i < UVFS_REPLY_HASH_SIZE; i++)
+    {
+        hlist_for_each_entry_safe(trans, node, tmp, &chan->replies[i], hash)
+        {
+            if (test_bit(UVFS_TRANS_IN_USE, &trans->state))
+                continue;
+            hlist_del_init(&trans->hash);
+            trans->u.reply.generic.error = error;
+            uvfs_answer(trans);
+        }
+    }
+    spin_unlock(&chan->reply_lock);
+}
+
+
+/*
+ * A daemon fd stops serving chan.  When the last one goes, every request
+ * still queued or in flight on the channel fails with -EIO.
+ */
+static void uvfs_channel_close(uvfs_channel_s* chan)
+{
+    if (atomic_dec_and_test(&chan->use_count))
+    {
+        /*
+           uvfs_make_request checks the use count under the shard
+           lock, so nothing is queued behind us once we have drained
+           every shard.
+        */
+        uvfs_channel_fail(chan, -EIO);
+        spin_lock(&chan->lock);
+        if (atomic_read(&chan->use_count) == 0)
+        {
+            chan->shutting_down = 0;
+            atomic_set(&chan->serial_number, 0);
+            chan->cancel = 0;
+            chan->stalled = 0;
+            uvfs_channel_defaults(chan);
+        }
+        spin_unlock(&chan->lock);
+    }
+}
+
+
+/* The daemon is reading requests or replying, so it isn't stuck. */
+
+static void uvfs_daemon_alive(uvfs_channel_s* chan)
+{
+    if (ACCESS_ONCE(chan->stalled))
+    {
+        spin_lock(&chan->lock);
+        chan->stalled = 0;
+        chan->last_progress = jiffies;
+        spin_unlock(&chan->lock);
+    }
+}
+
+
+/*
+ * The fd starts serving its channel: reading, polling, replying, saying
+ * hello or setting up a ring.  Only from here on does it count as a
+ * daemon of the channel, so a tool that just opens the device for an
+ * ioctl doesn't keep a dead channel looking served.  UVFS_IOCTL_CHANNEL
+ * fails after this, so the channel returned stays the fd's channel.
+ */
+static uvfs_channel_s* uvfs_daemon_start(uvfsd_file_s* dfile)
+{
+    if (!ACCESS_ONCE(dfile->started))
+    {
+        spin_lock(&dfile->lock);
+        if (!dfile->started)
+        {
+            uvfs_channel_open(dfile->channel);
+            dfile->started = 1;
+        }
+        spin_unlock(&dfile->lock);
+    }
+    return dfile->channel;
+}
+
+
+/*
+ * The fd takes requests from chan.  One that never said hello only knows
+ * the version 1 layouts, so while it is open the channel goes back to
+ * those and HELLO won't enable UVFS_LAYOUT_FEATURES again.  Say hello
+ * before reading, polling or setting up a ring.
+ */
+static void uvfs_daemon_reads(uvfsd_file_s* dfile, uvfs_channel_s* chan)
+{
+    if (ACCESS_ONCE(dfile->legacy) || ACCESS_ONCE(dfile->hello))
+        return;
+    spin_lock(&chan->lock);
+    if (!dfile->legacy && !dfile->hello)
+    {
+        dfile->legacy = 1;
+        chan->legacy++;
+        chan->version = 1;
+        chan->features &= ~UVFS_LAYOUT_FEATURES;
+    }
+    spin_unlock(&chan->lock);
+}
+
+
+/*
+ * open the driver for access by server file system thread
+ * driver can be opened muliple times by different threads
+ */
+static int uvfsd_open(struct inode* inode, struct file* file)
+{
+    uvfsd_file_s* dfile;
+
+    dfile = kmalloc(sizeof(*dfile), GFP_KERNEL);
+    if (dfile == NULL)
+        return -ENOMEM;
+    spin_lock_init(&dfile->lock);
+    dfile->channel = Uvfs_channels[0];
+    dfile->started = 0;
+    dfile->hello = 0;
+    dfile->legacy = 0;
+    dfile->shard = uvfs_cpu_shard(raw_smp_processor_id());
+    dfile->features = 0;
+    dfile->ring = NULL;
+    file->private_data = dfile;
+    return 0;
+}
+
+
+/*
+ * close the driver from file system thread
+ * each thread must close the connection to unload driver
+ */
+static int uvfsd_release(struct inode* inode, struct file* filp)
+{
+    uvfsd_file_s* dfile = filp->private_data;
+
+    if (dfile->ring != NULL)
+        uvfs_ring_destroy(dfile);
+    if (dfile->legacy)
+    {
+        spin_lock(&dfile->channel->lock);
+        dfile->channel->legacy--;
+        spin_unlock(&dfile->channel->lock);
+    }
+    if (dfile->started)
+        uvfs_channel_close(dfile->channel);
+    kfree(dfile);
+    return 0;
+}
+
+
+/*
+ * Reads are user space queries for fs request.  With UVFS_FEATURE_BATCH_READ
+ * enabled, one read drains up to UVFS_MAX_BATCH queued requests into the
+ * buffer, each starting at the UVFS_BATCH_ALIGN'ed end of the one before.
+ */
+
+static ssize_t uvfsd_read(struct file* filp,
+                          char* buff,
+                          size_t count,
+                          loff_t* offset)
+{
+    int ret = 0;
+    int size;
+    int nr = 0;
+    size_t done = 0;
+    uvfs_transaction_s* trans;
+    uvfsd_file_s* dfile = filp->private_data;
+    uvfs_channel_s* chan = uvfs_daemon_start(dfile);
+    uvfs_shard_s* home = &chan->shards[dfile->shard];
+    dprintk("<1>Entered uvfsd_read (%d)\n", current->pid);
+
+    /* Check for bogus count. */
+    if (count < sizeof(uvfs_request_u))
+    {
+        dprintk("<1>uvfsd_read EIO (%d)(%d)\n", count, sizeof(uvfs_request_u));
+        return -EIO;
+    }
+    uvfs_daemon_reads(dfile, chan);
+    uvfs_daemon_alive(chan);
+    /* Wait for a request */
+    while (chan->shutting_down ||
+           (trans = uvfs_dequeue(chan, dfile->shard, count)) == NULL)
+    {
+        if (chan->shutting_down)
+        {
+            uvfs_shutdown_req_s req;
+            req.type = UVFS_SHUTDOWN;
+            size = req.size = sizeof(req);
+            ret = copy_to_user(buff, &req, req.size);
+            wake_up_interruptible(&home->driver_queue);
+            if(ret)
+                return -EIO;
+            else
+                return size;
+        }
+        ret = uvfs_wait_for_request(filp);
+        if (ret)
+            return ret;
+    }
+    /* There is a request ready, in flight and marked in use. */
+    do
+    {
+        size = trans->u.request.generic.size;
+        if (copy_to_user(buff + done, &trans->u.request, size))
+        {
+            uvfs_requeue(trans);
+            break;
+        }
+        uvfs_clear_in_use(trans);
+        done += UVFS_BATCH_ALIGN(size);
+        nr++;
+        if (!(dfile->features & UVFS_FEATURE_BATCH_READ) ||
+            nr >= UVFS_MAX_BATCH || done >= count)
+        {
+            break;
+        }
+        trans = uvfs_dequeue(chan, dfile->shard, count - done);
+    } while (trans != NULL);
+    dprintk("<1>Exited uvfsd_read: %d requests %d bytes (%d)\n",
+            nr,
+            done,
+            current->pid);
+    if (nr == 0)
+        return -EIO;
+    else
+        return min(done, count);
+}
+
+
+/*
+ * Take the in-flight transaction with the given serial number out of the
+ * table and mark it in use while its reply is copied in.
+ */
+static uvfs_transaction_s* uvfs_claim_reply(uvfs_channel_s* chan, int serial)
+{
+    uvfs_transaction_s* trans;
+
+    spin_lock(&chan->reply_lock);
+    dprintk("<1>uvfsd_write: Looking for transaction serial=%d\n", serial);
+    trans = uvfs_find_reply(chan, serial);
+    if (trans == NULL)
+    {
+        dprintk("<1>uvfsd_write: invalid reply %d\n", serial);
+        spin_unlock(&chan->reply_lock);
+        return NULL;
+    }
+    /* We have a transaction */
+    dprintk("<1>uvfsd_write: found transaction\n");
+    hlist_del_init(&trans->hash);
+    set_bit(UVFS_TRANS_IN_USE, &trans->state);
+    spin_unlock(&chan->reply_lock);
+    return trans;
+}
+
+
+/* The reply is in place, wake the caller or run its callback. */
+
+static void uvfs_finish_reply(uvfs_transaction_s* trans, int error)
+{
+    uvfs_channel_s* chan = trans->channel;
+
+    if (error)
+        trans->u.reply.generic.error = error;
+    trans->t_replied = uvfs_clock();
+    spin_lock(&chan->reply_lock);
+    clear_bit(UVFS_TRANS_IN_USE, &trans->state);
+    uvfs_answer(trans);
+    spin_unlock(&chan->reply_lock);
+    ACCESS_ONCE(chan->last_progress) = jiffies;
+    uvfs_daemon_alive(chan);
+}
+
+
+/*
+ * The largest reply trans takes.  A READ into pages keeps only its
+ * header in the transaction, the data goes to the pages.
+ */
+static inline int uvfs_reply_room(uvfs_transaction_s* trans)
+{
+    if (trans->pages != NULL)
+        return offsetof(uvfs_file_read_rep_s, buff) +
+               (trans->nr_pages << PAGE_CACHE_SHIFT);
+    return trans->capacity;
+}
+
+
+/*
+ * Copy the reply of size bytes at buff, a user address if user is set,
+ * into trans.  The data of a READ into pages is copied page by page
+ * straight to where it belongs, so it crosses memory only once.
+ */
+static int uvfs_copy_reply(uvfs_transaction_s* trans,
+                           const char* buff,
+                           int size,
+                           int user)
+{
+    int done = size;
+    int count;
+    unsigned i;
+    char* kaddr;
+    int ret = 0;
+
+    if (trans->pages != NULL && size > offsetof(uvfs_file_read_rep_s, buff))
+        done = offsetof(uvfs_file_read_rep_s, buff);
+    if (user)
+        ret = copy_from_user(&trans->u.reply, buff, done);
+    else
+        memcpy(&trans->u.reply, buff, done);
+    for (i = 0; ret == 0 && done < size; i++)
+    {
+        count = min_t(int, size - done, PAGE_CACHE_SIZE);
+        kaddr = kmap(trans->pages[i]);
+        if (user)
+            ret = copy_from_user(kaddr, buff + done, count);
+        else
+            memcpy(kaddr, buff + done, count);
+        kunmap(trans->pages[i]);
+        done += count;
+    }
+    return ret ? -EIO : 0;
+}
+
+
+/*
+ * Hand the reply of size bytes at buff to the in-flight transaction
+ * with the given serial number and wake its caller.
+ */
+static int uvfs_complete_reply(uvfs_channel_s* chan,
+                               const char* buff,
+                               int serial,
+                               int size)
+{
+    int ret;
+    uvfs_transaction_s* trans;
+
+    trans = uvfs_claim_reply(chan, serial);
+    if (trans == NULL)
+        return -EINVAL;
+    trace_uvfs_reply(trans, size);
+    if (size > uvfs_reply_room(trans))
+    {
+        dprintk("<1>uvfsd_write: reply %d too large %d\n", serial, size);
+        uvfs_finish_reply(trans, -EIO);
+        return -EINVAL;
+    }
+    ret = uvfs_copy_reply(trans, buff, size, 1);
+    uvfs_finish_reply(trans, ret);
+    return ret;
+}
+
+
+/*
+ * Writes are replies from the user space filesystem implementation.
+ * With UVFS_FEATURE_BATCH_WRITE enabled, one write may carry several
+ * replies packed the same way as batched requests.  The return value
+ * covers the replies completed before the first bad one.
+ */
+
+static ssize_t uvfsd_write(struct file* file,
+                           const char* buff,
+                           size_t count,
+                           loff_t* offset)
+{
+    int error = 0;
+    size_t done = 0;
+    uvfs_generic_rep_s reply;
+    uvfsd_file_s* dfile = file->private_data;
+    dprintk("<1>Entered uvfsd_write: count=%d (%d)\n", count, current->pid);
+    uvfs_daemon_start(dfile);
+    while (done < count)
+    {
+        if (count - done < sizeof(uvfs_generic_rep_s))
+        {
+            dprintk("<1>uvfsd_write Undersized reply (%d).\n", count - done);
+            error = -EIO;
+            break;
+        }
+        if (copy_from_user(&reply, buff + done, sizeof(reply)))
+        {
+            dprintk("<1>copy_from_user failed in uvfsd_write.\n");
+            error = -EFAULT;
+            break;
+        }
+        dprintk("<1>uvfsd_write: serial=%d size=%d\n",
+                reply.serial, reply.size);
+        /* uvfs_complete_reply checks the size against the request */
+        if (reply.size < sizeof(reply) ||
+            reply.size > count - done ||
+            (reply.size != count &&
+             !(dfile->features & UVFS_FEATURE_BATCH_WRITE)))
+        {
+            dprintk("<1>Mismatched write size in uvfsd_write %d %d\n",
+                   reply.size, count - done);
+            error = -EINVAL;
+            break;
+        }
+        error = uvfs_complete_reply(dfile->channel, buff + done,
+                                    reply.serial, reply.size);
+        if (error)
+            break;
+        done += UVFS_BATCH_ALIGN(reply.size);
+    }
+    dprintk("<1>Exited uvfsd_write %d %d (%d)\n", done, error, current->pid);
+    if (done == 0)
+        return error;
+    else
+        return min(done, count);
+}
+
+
+/*
+ * Shared memory rings
+ */
+
+static inline void* uvfs_ring_slot(uvfs_ring_s* ring, char* base, unsigned i)
+{
+    return base + (i & (ring->entries - 1)) * ring->slot_size;
+}
+
+
+static int uvfs_ring_requests(uvfs_ring_s* ring)
+{
+    return ACCESS_ONCE(ring->hdr->sq_tail) - ACCESS_ONCE(ring->hdr->sq_head);
+}
+
+
+/*
+ * Copy an in-flight request into the next free request slot.  Returns
+ * 0 if the ring is full, otherwise 1, or 2 if the ring was empty and a
+ * sleeping daemon needs a doorbell.
+ */
+static int uvfs_ring_post(uvfs_ring_s* ring, uvfs_transaction_s* trans)
+{
+    unsigned head, tail;
+    int size = trans->u.request.generic.size;
+
+    if (size > ring->slot_size)
+        return 0;
+    spin_lock(&ring->sq_lock);
+    tail = ring->hdr->sq_tail;
+    head = ACCESS_ONCE(ring->hdr->sq_head);
+    if (tail - head >= ring->entries)
+    {
+        spin_unlock(&ring->sq_lock);
+        return 0;
+    }
+    memcpy(uvfs_ring_slot(ring, ring->sq, tail), &trans->u.request, size);
+    smp_wmb();
+    ring->hdr->sq_tail = tail + 1;
+    spin_unlock(&ring->sq_lock);
+    return (head == tail) ? 2 : 1;
+}
+
+
+/* Post a shutdown request so a daemon using only the ring sees it. */
+
+static void uvfs_ring_post_shutdown(uvfs_ring_s* ring)
+{
+    unsigned tail;
+    uvfs_shutdown_req_s* req;
+
+    spin_lock(&ring->sq_lock);
+    tail = ring->hdr->sq_tail;
+    if (tail - ACCESS_ONCE(ring->hdr->sq_head) < ring->entries)
+    {
+        req = uvfs_ring_slot(ring, ring->sq, tail);
+        req->type = UVFS_SHUTDOWN;
+        req->serial = 0;
+        req->size = sizeof(*req);
+        smp_wmb();
+        ring->hdr->sq_tail = tail + 1;
+    }
+    spin_unlock(&ring->sq_lock);
+}
+
+
+/* Complete every reply the daemon has posted since the last call. */
+
+static int uvfs_ring_reap(uvfs_ring_s* ring)
+{
+    unsigned head, tail;
+    uvfs_generic_rep_s* reply;
+    uvfs_transaction_s* trans;
+    int size;
+    int error = 0;
+
+    mutex_lock(&ring->cq_mutex);
+    head = ring->hdr->cq_head;
+    tail = ACCESS_ONCE(ring->hdr->cq_tail);
+    while (head != tail)
+    {
+        if (tail - head > ring->entries)
+        {
+            dprintk("<1>uvfs_ring_reap: bad reply ring tail %u\n", tail);
+            error = -EINVAL;
+            break;
+        }
+        smp_rmb();
+        reply = uvfs_ring_slot(ring, ring->cq, head);
+        size = ACCESS_ONCE(reply->size);
+        if (size >= sizeof(*reply) && size <= ring->slot_size)
+        {
+            trans = uvfs_claim_reply(ring->channel, reply->serial);
+            if (trans != NULL && size > uvfs_reply_room(trans))
+            {
+                uvfs_finish_reply(trans, -EIO);
+            }
+            else if (trans != NULL)
+            {
+                uvfs_finish_reply(trans,
+                                  uvfs_copy_reply(trans, (char*)reply,
+                                                  size, 0));
+            }
+        }
+        head++;
+        /* the daemon rings the doorbell only if it sees the ring empty */
+        ring->hdr->cq_head = head;
+        smp_mb();
+        tail = ACCESS_ONCE(ring->hdr->cq_tail);
+    }
+    mutex_unlock(&ring->cq_mutex);
+    return error;
+}
+
+
+/* Move queued requests into the ring until it is full. */
+
+static void uvfs_ring_fill(uvfs_ring_s* ring, int home)
+{
+    uvfs_transaction_s* trans;
+
+    while (uvfs_ring_requests(ring) < ring->entries)
+    {
+        trans = uvfs_dequeue(ring->channel, home, ring->slot_size);
+        if (trans == NULL)
+            break;
+        if (!uvfs_ring_post(ring, trans))
+        {
+            uvfs_requeue(trans);
+            break;
+        }
+        uvfs_clear_in_use(trans);
+    }
+}
+
+
+/*
+ * Requests left in the ring of a closing fd go back on the queue for
+ * the other daemon threads, unless they have been answered meanwhile.
+ */
+static void uvfs_ring_requeue(uvfs_ring_s* ring)
+{
+    unsigned head, tail;
+    uvfs_generic_req_s* req;
+    uvfs_transaction_s* trans;
+
+    head = ring->hdr->sq_head;
+    tail = ring->hdr->sq_tail;
+    if (tail - head > ring->entries)
+        head = tail - ring->entries;
+    for (; head != tail; head++)
+    {
+        req = uvfs_ring_slot(ring, ring->sq, head);
+        if (req->type == UVFS_SHUTDOWN)
+            continue;
+        trans = uvfs_claim_reply(ring->channel, req->serial);
+        if (trans != NULL)
+            uvfs_requeue(trans);
+    }
+}
+
+
+static void uvfs_ring_attach(uvfs_ring_s* ring, int shard)
+{
+    uvfs_shard_s* s = &ring->channel->shards[shard];
+
+    spin_lock(&s->lock);
+    if (s->ring == NULL)
+        s->ring = ring;
+    spin_unlock(&s->lock);
+}
+
+
+static void uvfs_ring_detach(uvfs_ring_s* ring, int shard)
+{
+    uvfs_shard_s* s = &ring->channel->shards[shard];
+
+    spin_lock(&s->lock);
+    if (s->ring == ring)
+        s->ring = NULL;
+    spin_unlock(&s->lock);
+}
+
+
+static int uvfs_ring_setup(uvfsd_file_s* dfile, uvfs_ring_setup_s* setup)
+{
+    uvfs_ring_s* ring;
+    unsigned slot_size;
+    unsigned long ring_size;
+
+    if (dfile->ring != NULL)
+        return -EBUSY;
+    if (setup->entries == 0 ||
+        setup->entries > UVFS_RING_MAX_ENTRIES ||
+        (setup->entries & (setup->entries - 1)))
+    {
+        return -EINVAL;
+    }
+    slot_size = max_t(unsigned, setup->slot_size, sizeof(uvfs_request_u));
+    slot_size = max_t(unsigned, slot_size, sizeof(uvfs_reply_u));
+    slot_size = ALIGN(slot_size, 64);
+    if (slot_size > UVFS_RING_MAX_SLOT)
+        return -EINVAL;
+    ring_size = setup->entries * slot_size;
+
+    ring = kmalloc(sizeof(*ring), GFP_KERNEL);
+    if (ring == NULL)
+        return -ENOMEM;
+    ring->channel = dfile->channel;
+    ring->entries = setup->entries;
+    ring->slot_size = slot_size;
+    ring->mmap_size = PAGE_SIZE + 2 * PAGE_ALIGN(ring_size);
+    ring->hdr = vmalloc_user(ring->mmap_size);
+    if (ring->hdr == NULL)
+    {
+        kfree(ring);
+        return -ENOMEM;
+    }
+    ring->sq = (char*)ring->hdr + PAGE_SIZE;
+    ring->cq = ring->sq + PAGE_ALIGN(ring_size);
+    spin_lock_init(&ring->sq_lock);
+    mutex_init(&ring->cq_mutex);
+    init_waitqueue_head(&ring->wait);
+
+    setup->slot_size = slot_size;
+    setup->sq_offset = ring->sq - (char*)ring->hdr;
+    setup->cq_offset = ring->cq - (char*)ring->hdr;
+    setup->mmap_size = ring->mmap_size;
+
+    spin_lock(&ring->channel->lock);
+    if (ring->channel->slot_size == 0 || slot_size < ring->channel->slot_size)
+        ring->channel->slot_size = slot_size;
+    uvfs_channel_fit_slot(ring->channel);
+    spin_unlock(&ring->channel->lock);
+
+    dfile->ring = ring;
+    uvfs_ring_attach(ring, dfile->shard);
+    return 0;
+}
+
+
+static void uvfs_ring_destroy(uvfsd_file_s* dfile)
+{
+    uvfs_ring_s* ring = dfile->ring;
+
+    uvfs_ring_detach(ring, dfile->shard);
+    uvfs_ring_reap(ring);
+    uvfs_ring_requeue(ring);
+    vfree(ring->hdr);
+    kfree(ring);
+    dfile->ring = NULL;
+}
+
+
+static int uvfs_ring_enter(struct file* filp, unsigned flags)
+{
+    uvfsd_file_s* dfile = filp->private_data;
+    uvfs_ring_s* ring = dfile->ring;
+    int error;
+
+    if (ring == NULL)
+        return -EINVAL;
+    uvfs_daemon_alive(ring->channel);
+    error = uvfs_ring_reap(ring);
+    if (error)
+        return error;
+    for (;;)
+    {
+        if (ring->channel->shutting_down)
+        {
+            uvfs_ring_post_shutdown(ring);
+            wake_up_interruptible(&ring->channel->shards[dfile->shard].driver_queue);
+            break;
+        }
+        uvfs_ring_fill(ring, dfile->shard);
+        if (uvfs_ring_requests(ring) > 0 || !(flags & UVFS_RING_ENTER_WAIT))
+            break;
+        error = uvfs_wait_for_request(filp);
+        if (error)
+            return error;
+    }
+    return uvfs_ring_requests(ring);
+}
+
+
+static int uvfsd_mmap(struct file* filp, struct vm_area_struct* vma)
+{
+    uvfsd_file_s* dfile = filp->private_data;
+
+    if (dfile->ring == NULL || vma->vm_pgoff != 0 ||
+        vma->vm_end - vma->vm_start != dfile->ring->mmap_size)
+    {
+        return -EINVAL;
+    }
+    return remap_vmalloc_range(vma, dfile->ring->hdr, 0);
+}
+
+
+/*
+ * The pmfs device is readable when a request is waiting, so a daemon can
+ * put it in its poll or epoll set.  Replies never block.
+ */
+static unsigned int uvfsd_poll(struct file* filp, poll_table* wait)
+{
+    uvfsd_file_s* dfile = filp->private_data;
+    uvfs_channel_s* chan = uvfs_daemon_start(dfile);
+    unsigned int mask = POLLOUT | POLLWRNORM;
+
+    uvfs_daemon_reads(dfile, chan);
+    poll_wait(filp, &chan->shards[dfile->shard].driver_queue, wait);
+    if (dfile->ring != NULL)
+        poll_wait(filp, &dfile->ring->wait, wait);
+    if (uvfs_daemon_has_work(dfile))
+        mask |= POLLIN | POLLRDNORM;
+    return mask;
+}
+
+
+/* Count one pending request of type in a snapshot. */
+
+static void uvfs_snapshot_add(uvfs_snapshot_s* snap,
+                              uvfs_transaction_s* trans,
+                              int in_flight,
+                              unsigned age_ms)
+{
+    uvfs_snapshot_op_s* op;
+    int type = trans->type;
+
+    if (type < 0 || type >= UVFS_SNAPSHOT_OPS)
+        type = 0;
+    op = &snap->ops[type];
+    if (in_flight)
+    {
+        snap->in_flight++;
+        op->in_flight++;
+        op->oldest_in_flight_ms = max(op->oldest_in_flight_ms, age_ms);
+    }
+    else
+    {
+        snap->queued++;
+        op->queued++;
+        op->oldest_queued_ms = max(op->oldest_queued_ms, age_ms);
+    }
+    if (snap->low_serial < 0 || trans->serial < snap->low_serial)
+        snap->low_serial = trans->serial;
+    if (trans->serial > snap->high_serial)
+        snap->high_serial = trans->serial;
+}
+
+
+/*
+ * Fill in a snapshot of chan.  Each shard and each reply bucket is
+ * looked at under its own lock, none are held for the whole walk.
+ */
+static void uvfs_snapshot(uvfs_channel_s* chan, uvfs_snapshot_s* snap)
+{
+    uvfs_transaction_s* trans;
+    struct hlist_node* node;
+    unsigned long long total[UVFS_NR_PRIOS];
+    unsigned long max[UVFS_NR_PRIOS];
+    unsigned long nr[UVFS_NR_PRIOS];
+    u64 now = uvfs_clock();
+    u64 age;
+    int i, prio;
+
+    BUILD_BUG_ON(UVFS_SNAPSHOT_OPS != ARRAY_SIZE(Op_names) - 1);
+    BUILD_BUG_ON(UVFS_SNAPSHOT_PRIOS != UVFS_NR_PRIOS);
+
+    memset(snap, 0, sizeof(*snap));
+    memset(total, 0, sizeof(total));
+    memset(max, 0, sizeof(max));
+    memset(nr, 0, sizeof(nr));
+    snap->low_serial = -1;
+    snap->high_serial = -1;
+    snap->shards = Uvfs_nr_shards;
+
+    for (i = 0; i < Uvfs_nr_shards; i++)
+    {
+        uvfs_shard_s* shard = &chan->shards[i];
+        spin_lock(&shard->lock);
+        for (prio = 0; prio < UVFS_NR_PRIOS; prio++)
+        {
+            list_for_each_entry(trans, &shard->requests[prio], list)
+            {
+                uvfs_snapshot_add(snap, trans, 0,
+                                  jiffies_to_msecs(jiffies - trans->queued));
+                snap->prio_queued[prio]++;
+            }
+            total[prio] += shard->wait_total[prio];
+            nr[prio] += shard->wait_count[prio];
+            if (shard->wait_max[prio] > max[prio])
+                max[prio] = shard->wait_max[prio];
+        }
+        spin_unlock(&shard->lock);
+    }
+    for (prio = 0; prio < UVFS_NR_PRIOS; prio++)
+    {
+        if (nr[prio])
+            do_div(total[prio], nr[prio]);
+        snap->prio_wait_count[prio] = nr[prio];
+        snap->prio_wait_avg_ms[prio] =
+            jiffies_to_msecs((unsigned long)total[prio]);
+        snap->prio_wait_max_ms[prio] = jiffies_to_msecs(max[prio]);
+    }
+
+    for (i = 0; i < UVFS_REPLY_HASH_SIZE; i++)
+    {
+        spin_lock(&chan->reply_lock);
+        hlist_for_each_entry(trans, node, &chan->replies[i], hash)
+        {
+            age = (trans->t_dequeued && now > trans->t_dequeued) ?
+                  now - trans->t_dequeued : 0;
+            do_div(age, 1000000);
+            uvfs_snapshot_add(snap, trans, 1, (unsigned)age);
+        }
+        spin_unlock(&chan->reply_lock);
+    }
+
+    spin_lock(&chan->lock);
+    snap->channel = chan->id;
+    snap->mounts = chan->mounts;
+    snap->shutting_down = chan->shutting_down;
+    snap->stalled = chan->stalled;
+    spin_unlock(&chan->lock);
+    snap->fds = atomic_read(&chan->use_count);
+    snap->next_serial = atomic_read(&chan->serial_number);
+    snap->coalesced = ACCESS_ONCE(chan->coalesced);
+}
+
+
+static inline unsigned uvfs_hello_limit(unsigned daemon, unsigned module)
+{
+    return (daemon == 0 || daemon > module) ? module : daemon;
+}
+
+
+/*
+ * Agree on a protocol version, features and limits with the daemon fd
+ * dfile, see UVFS_IOCTL_HELLO.  The first fd to say hello on a channel
+ * sets its limits and the ones after it can only lower them.
+ */
+static int uvfs_channel_hello(uvfsd_file_s* dfile, uvfs_hello_s* hello)
+{
+    uvfs_channel_s* chan = dfile->channel;
+
+    if (hello->version == 0)
+        return -EINVAL;
+    if (hello->version > UVFS_PROTOCOL_VERSION)
+        hello->version = UVFS_PROTOCOL_VERSION;
+    hello->features &= UVFS_SUPPORTED_FEATURES;
+    hello->max_read = uvfs_hello_limit(hello->max_read,
+                                       UVFS_MODULE_MAX_READ);
+    hello->max_write = uvfs_hello_limit(hello->max_write,
+                                        UVFS_MODULE_MAX_WRITE);
+    hello->max_readdir = uvfs_hello_limit(hello->max_readdir,
+                                          UVFS_MODULE_MAX_READDIR);
+
+    spin_lock(&chan->lock);
+    if (chan->legacy)
+    {
+        /* a fd without hello reads requests too */
+        hello->version = 1;
+        hello->features &= ~UVFS_LAYOUT_FEATURES;
+    }
+    if (!dfile->legacy)
+        dfile->hello = 1;
+    dfile->features = hello->features;
+    if (!chan->hello)
+    {
+        chan->hello = 1;
+        chan->version = hello->version;
+        chan->features = hello->features;
+        chan->max_read = hello->max_read;
+        chan->max_write = hello->max_write;
+        chan->max_readdir = hello->max_readdir;
+    }
+    else
+    {
+        chan->version = min(chan->version, hello->version);
+        chan->features &= hello->features;
+        chan->max_read = min(chan->max_read, hello->max_read);
+        chan->max_write = min(chan->max_write, hello->max_write);
+        chan->max_readdir = min(chan->max_readdir, hello->max_readdir);
+    }
+    uvfs_channel_fit_slot(chan);
+    if (hello->features & UVFS_FEATURE_CANCEL)
+        chan->cancel = 1;
+    hello->max_read = chan->max_read;
+    hello->max_write = chan->max_write;
+    hello->max_readdir = chan->max_readdir;
+    spin_unlock(&chan->lock);
+    return 0;
+}
+
+
+/* Used to signal the user-space filesystem to shutdown, cmd = 0 */
+
+static int uvfsd_ioctl(struct inode* inode, struct file* filp,
+                       unsigned int cmd, unsigned long arg)
+{
+    uvfsd_file_s* dfile = filp->private_data;
+    uvfs_channel_s* chan = dfile->channel;
+
+    switch (cmd)
+    {
+        case UVFS_IOCTL_SHUTDOWN:
+        {
+            dprintk("Entering uvfsd_ioctl SHUTDOWN\n");
+            spin_lock(&chan->lock);
+            chan->shutting_down = 1;
+            spin_unlock(&chan->lock);
+            uvfs_wake_all_daemons(chan);
+            return 0;
+        }
+        case UVFS_IOCTL_CHANNEL:
+        {
+            // serve channel arg instead, before the fd serves any
+            if (arg >= UVFS_MAX_CHANNELS)
+                return -EINVAL;
+            spin_lock(&dfile->lock);
+            if (dfile->started)
+            {
+                spin_unlock(&dfile->lock);
+                return -EBUSY;
+            }
+            dfile->channel = Uvfs_channels[arg];
+            spin_unlock(&dfile->lock);
+            return 0;
+        }
+        case UVFS_IOCTL_SHARDS:
+        {
+            // return number of request shards
+            return Uvfs_nr_shards;
+        }
+        case UVFS_IOCTL_FEATURES:
+        {
+            // enable the requested features this module supports on this fd
+            dfile->features = arg & UVFS_SUPPORTED_FEATURES &
+                              ~UVFS_LAYOUT_FEATURES;
+            if (dfile->features & UVFS_FEATURE_CANCEL)
+                chan->cancel = 1;
+            return dfile->features;
+        }
+        case UVFS_IOCTL_HELLO:
+        {
+            // negotiate the protocol version, features and sizes
+            uvfs_hello_s hello;
+            int error;
+            if (copy_from_user(&hello, (void*)arg, sizeof(hello)))
+                return -EFAULT;
+            uvfs_daemon_start(dfile);
+            error = uvfs_channel_hello(dfile, &hello);
+            if (error)
+                return error;
+            if (copy_to_user((void*)arg, &hello, sizeof(hello)))
+                return -EFAULT;
+            return 0;
+        }
+        case UVFS_IOCTL_BIND_SHARD:
+        {
+            // make shard arg the home shard of this fd
+            if (arg >= Uvfs_nr_shards)
+                return -EINVAL;
+            if (dfile->ring != NULL)
+            {
+                uvfs_ring_detach(dfile->ring, dfile->shard);
+                uvfs_ring_attach(dfile->ring, arg);
+            }
+            dfile->shard = arg;
+            return 0;
+        }
+        case UVFS_IOCTL_RING_SETUP:
+        {
+            // set up the shared request and reply rings for mmap
+            uvfs_ring_setup_s setup;
+            int error;
+            if (copy_from_user(&setup, (void*)arg, sizeof(setup)))
+                return -EFAULT;
+            uvfs_daemon_reads(dfile, uvfs_daemon_start(dfile));
+            error = uvfs_ring_setup(dfile, &setup);
+            if (error)
+                return error;
+            if (copy_to_user((void*)arg, &setup, sizeof(setup)))
+                return -EFAULT;
+            return 0;
+        }
+        case UVFS_IOCTL_RING_ENTER:
+        {
+            // reap replies, refill requests, optionally wait for work
+            return uvfs_ring_enter(filp, arg);
+        }
+        case UVFS_IOCTL_SNAPSHOT:
+        {
+            // copy as much of a uvfs_snapshot_s as the caller has room for
+            uvfs_snapshot_s snap;
+            unsigned size;
+            if (copy_from_user(&size, (void*)arg, sizeof(size)))
+                return -EFAULT;
+            if (size < offsetof(uvfs_snapshot_s, channel))
+                return -EINVAL;
+            if (size > sizeof(snap))
+                size = sizeof(snap);
+            uvfs_snapshot(chan, &snap);
+            snap.size = size;
+            snap.ops_offset = offsetof(uvfs_snapshot_s, ops);
+            snap.nr_ops = 0;
+            if (size > snap.ops_offset)
+                snap.nr_ops = (size - snap.ops_offset) /
+                              sizeof(uvfs_snapshot_op_s);
+            if (copy_to_user((void*)arg, &snap, size))
+                return -EFAULT;
+            return 0;
+        }
+        case UVFS_IOCTL_STATUS:
+        {
+            // print a summary of the snapshot
+            uvfs_snapshot_s snap;
+            int i;
+            uvfs_snapshot(chan, &snap);
+            printk("<1>pmfs channel %d: %d fds, %d mounts, "
+                   "%u queued, %u in flight, serials %d-%d, next %d\n",
+                   snap.channel, snap.fds, snap.mounts,
+                   snap.queued, snap.in_flight,
+                   snap.low_serial, snap.high_serial, snap.next_serial);
+            for (i = 0; i < UVFS_SNAPSHOT_OPS; i++)
+            {
+                uvfs_snapshot_op_s* op = &snap.ops[i];
+                if (op->queued == 0 && op->in_flight == 0)
+                    continue;
+                printk("<1>%s: %u queued (oldest %u ms), "
+                       "%u in flight (oldest %u ms)\n",
+                       Op_names[i], op->queued, op->oldest_queued_ms,
+                       op->in_flight, op->oldest_in_flight_ms);
+            }
+            for (i = 0; i < UVFS_NR_PRIOS; i++)
+            {
+                printk("<1>%s: %u queued, %u served, "
+                       "wait avg %u ms, max %u ms\n",
+                       Prio_names[i], snap.prio_queued[i],
+                       snap.prio_wait_count[i], snap.prio_wait_avg_ms[i],
+                       snap.prio_wait_max_ms[i]);
+            }
+            printk("<1>Coalesced requests: %u\n", snap.coalesced);
+            break;
+        }
+        case UVFS_IOCTL_MOUNT:
+        {
+            // make sure nothing is mounted on this channel
+            return ACCESS_ONCE(chan->mounts) != 0;
+        }
+        case UVFS_IOCTL_USE_COUNT:
+        default:
+            // return number of opens active on this channel
+            return atomic_read(&chan->use_count);
+    }
+    return 0;
+}
+
+
+/*
+ * Tell the daemon the caller of serial gave up on it.  Best effort, the
+ * reply is dropped when it comes in either way.
+ */
+static void uvfs_post_cancel(uvfs_channel_s* chan, int serial)
+{
+    uvfs_transaction_s* trans;
+    uvfs_cancel_req_s* request;
+    uvfs_shard_s* shard;
+    int home;
+
+    if (!ACCESS_ONCE(chan->cancel))
+        return;
+    trans = uvfs_alloc_transaction(chan, UVFS_CANCEL, 0);
+    if (trans == NULL)
+        return;
+    trans->noreply = 1;
+    request = &trans->u.request.cancel;
+    request->type = UVFS_CANCEL;
+    request->serial = trans->serial;
+    request->size = sizeof(*request);
+    request->cancel_serial = serial;
+
+    home = uvfs_cpu_shard(raw_smp_processor_id());
+    trans->shard = home;
+    shard = &chan->shards[home];
+    spin_lock(&shard->lock);
+    if (atomic_read(&chan->use_count) == 0)
+    {
+        spin_unlock(&shard->lock);
+        uvfs_free_transaction(trans);
+        return;
+    }
+    trans->queued = jiffies;
+    list_add_tail(&trans->list, &shard->requests[trans->prio]);
+    shard->queued++;
+    /* a daemon may copy out and free the CANCEL as soon as we unlock */
+    spin_unlock(&shard->lock);
+    uvfs_wake_daemon(chan, home);
+}
+
+
+/*
+ * Called by a caller whose wait timed out, and by the channel tick.  If
+ * chan has had requests pending and no replies for watchdog_secs, the
+ * daemon is taken to be stuck: everything pending fails, and so do new
+ * requests until the daemon shows signs of life.
+ */
+static void uvfs_watchdog(uvfs_channel_s* chan)
+{
+    int fire;
+
+    if (watchdog_secs <= 0 || atomic_read(&chan->pending) == 0 ||
+        time_before(jiffies,
+                    ACCESS_ONCE(chan->last_progress) + watchdog_secs * HZ))
+    {
+        return;
+    }
+    spin_lock(&chan->lock);
+    fire = !chan->stalled;
+    chan->stalled = 1;
+    spin_unlock(&chan->lock);
+    if (fire)
+        printk(KERN_WARNING "pmfs: channel %d: no replies for %d seconds, "
+               "failing pending requests\n", chan->id, watchdog_secs);
+    uvfs_channel_fail(chan, -EIO);
+}
+
+
+/* Asynchronous requests that time out and were sent get a CANCEL. */
+
+#define UVFS_EXPIRE_BATCH 16
+
+static inline int uvfs_expired(uvfs_transaction_s* trans)
+{
+    return trans->deadline != 0 && time_after_eq(jiffies, trans->deadline);
+}
+
+
+/*
+ * Fail the asynchronous requests on chan whose op_timeout deadline has
+ * passed with -ETIMEDOUT, as a caller that stopped waiting would.  Only
+ * a batch of ones the daemon has already seen goes each time, and ones
+ * it is copying right now wait for the next tick.
+ */
+static void uvfs_channel_expire(uvfs_channel_s* chan)
+{
+    uvfs_transaction_s* trans;
+    uvfs_transaction_s* next;
+    struct hlist_node* node;
+    struct hlist_node* tmp;
+    int cancel[UVFS_EXPIRE_BATCH];
+    int nr_cancel = 0;
+    int i, prio;
+
+    for (i = 0; i < Uvfs_nr_shards; i++)
+    {
+        uvfs_shard_s* shard = &chan->shards[i];
+        spin_lock(&shard->lock);
+        for (prio = 0; prio < UVFS_NR_PRIOS; prio++)
+        {
+            list_for_each_entry_safe(trans, next, &shard->requests[prio], list)
+            {
+                if (!uvfs_expired(trans))
+                    continue;
+                list_del_init(&trans->list);
+                shard->queued--;
+                trans->u.reply.generic.error = -ETIMEDOUT;
+                trace_uvfs_abort(trans, -ETIMEDOUT, 0);
+                uvfs_answer(trans);
+            }
+        }
+        spin_unlock(&shard->lock);
+    }
+    spin_lock(&chan->reply_lock);
+    for (i = 0; i < UVFS_REPLY_HASH_SIZE; i++)
+    {
+        hlist_for_each_entry_safe(trans, node, tmp, &chan->replies[i], hash)
+        {
+            if (nr_cancel == UVFS_EXPIRE_BATCH)
+                break;
+            if (!uvfs_expired(trans) ||
+                test_bit(UVFS_TRANS_IN_USE, &trans->state))
+            {
+                continue;
+            }
+            hlist_del_init(&trans->hash);
+            cancel[nr_cancel++] = trans->serial;
+            trans->u.reply.generic.error = -ETIMEDOUT;
+            trace_uvfs_abort(trans, -ETIMEDOUT, 1);
+            uvfs_answer(trans);
+        }
+    }
+    spin_unlock(&chan->reply_lock);
+    /* let the daemon stop working on them */
+    for (i = 0; i < nr_cancel; i++)
+        uvfs_post_cancel(chan, cancel[i]);
+}
+
+
+/*
+ * Nobody waits on asynchronous requests to notice a stuck daemon or a
+ * passed deadline, so while chan has requests pending this runs every
+ * second to do it for them.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+static void uvfs_channel_tick(struct work_struct* work)
+{
+    uvfs_channel_s* chan = container_of(work, uvfs_channel_s, tick.work);
+#else
+static void uvfs_channel_tick(void* data)
+{
+    uvfs_channel_s* chan = data;
+#endif
+    uvfs_watchdog(chan);
+    uvfs_channel_expire(chan);
+    if (atomic_read(&chan->pending) > 0)
+        queue_delayed_work(Uvfs_workqueue, &chan->tick, HZ);
+}
+
+
+/* The reply to trans is in, or the leader it follows gave up. */
+
+static inline int uvfs_reply_ready(uvfs_transaction_s* trans)
+{
+    return (trans->state & (1UL << UVFS_TRANS_ANSWERED |
+                            1UL << UVFS_TRANS_RETRY)) != 0;
+}
+
+
+/*
+ * Callers of requests only give up for SIGKILL.  Since 2.6.25 they sleep
+ * killable, so other signals stay pending and nobody has to touch the
+ * signal mask.  Older kernels block every other signal for the duration
+ * of the request and sleep interruptible.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
+
+static inline void uvfs_block_signals(sigset_t* oldset)
+{
+}
+
+static inline void uvfs_restore_signals(sigset_t* oldset)
+{
+}
+
+static inline int uvfs_killed(void)
+{
+    return fatal_signal_pending(current);
+}
+
+/* Like wait_event_interruptible_timeout, but only SIGKILL wakes us. */
+
+static long uvfs_wait_killable(uvfs_transaction_s* trans, long timeout)
+{
+    DEFINE_WAIT(wait);
+
+    for (;;)
+    {
+        prepare_to_wait(&trans->fs_queue, &wait, TASK_KILLABLE);
+        if (uvfs_reply_ready(trans) || fatal_signal_pending(current))
+            break;
+        timeout = schedule_timeout(timeout);
+        if (timeout == 0)
+            break;
+    }
+    finish_wait(&trans->fs_queue, &wait);
+    return timeout;
+}
+
+#else
+
+/* Allow these signals to interrupt a request in progress */
+#define ALLOWED_SIGS   (sigmask(SIGKILL))
+
+static void uvfs_block_signals(sigset_t* oldset)
+{
+    unsigned long irqflags;
+
+    /* Mask all signals except ALLOWED_SIGS while we wait */
+    spin_lock_irqsave(&current->sighand->siglock, irqflags);
+    *oldset = current->blocked;
+    siginitsetinv(&current->blocked, ALLOWED_SIGS & ~oldset->sig[0]);
+    recalc_sigpending();
+    spin_unlock_irqrestore(&current->sighand->siglock, irqflags);
+}
+
+static void uvfs_restore_signals(sigset_t* oldset)
+{
+    unsigned long irqflags;
+
+    /* Restore the original signal mask */
+    spin_lock_irqsave(&current->sighand->siglock, irqflags);
+    current->blocked = *oldset;
+    recalc_sigpending();
+    spin_unlock_irqrestore(&current->sighand->siglock, irqflags);
+}
+
+static inline int uvfs_killed(void)
+{
+    return signal_pending(current);
+}
+
+static long uvfs_wait_killable(uvfs_transaction_s* trans, long timeout)
+{
+    return wait_event_interruptible_timeout(trans->fs_queue,
+                                            uvfs_reply_ready(trans),
+                                            timeout);
+}
+
+#endif
+
+
+/*
+ * Wait for the reply to trans, until SIGKILL, the deadline of its type
+ * or the watchdog.  Returns nonzero if the deadline passed.
+ */
+static int uvfs_wait_reply(uvfs_transaction_s* trans, int type)
+{
+    unsigned long deadline = 0;
+    long timeout;
+
+    if (type < ARRAY_SIZE(op_timeout) && op_timeout[type] > 0)
+        deadline = jiffies + op_timeout[type] * HZ;
+    for (;;)
+    {
+        timeout = MAX_SCHEDULE_TIMEOUT;
+        if (deadline)
+        {
+            if (time_after_eq(jiffies, deadline))
+                return 1;
+            timeout = deadline - jiffies;
+        }
+        if (watchdog_secs > 0)
+            timeout = min_t(long, timeout, watchdog_secs * HZ);
+        if (uvfs_wait_killable(trans, timeout) != 0)
+            return 0;
+        uvfs_watchdog(trans->channel);
+    }
+}
+
+
+/*
+ * Queue trans for the daemon of its channel, or post it straight to a
+ * ring.  Returns -EIO if no daemon serves the channel.
+ */
+static int uvfs_submit(uvfs_transaction_s* trans)
+{
+    uvfs_channel_s* chan = trans->channel;
+    uvfs_shard_s* shard;
+    int posted = 0;
+    int home;
+
+    /* Make sure the server is running, and add our request to the queue */
+    home = uvfs_cpu_shard(raw_smp_processor_id());
+    trans->shard = home;
+    shard = &chan->shards[home];
+    spin_lock(&shard->lock);
+    if (atomic_read(&chan->use_count) == 0 || ACCESS_ONCE(chan->stalled))
+    {
+        trans->u.reply.generic.error = -EIO;
+        spin_unlock(&shard->lock);
+        return -EIO;
+    }
+    if (atomic_inc_return(&chan->pending) == 1)
+        chan->last_progress = jiffies;
+    trans->t_queued = uvfs_clock();
+    trace_uvfs_enqueue(trans);
+    if (shard->ring != NULL && shard->queued == 0)
+    {
+        /* hand it straight to the daemon's ring if there is room */
+        spin_lock(&chan->reply_lock);
+        hlist_add_head(&trans->hash, uvfs_reply_bucket(chan, trans->serial));
+        spin_unlock(&chan->reply_lock);
+        /* once posted it can be answered and freed, trace it first */
+        trans->t_dequeued = trans->t_queued;
+        trace_uvfs_dequeue(trans);
+        posted = uvfs_ring_post(shard->ring, trans);
+        if (!posted)
+        {
+            trans->t_dequeued = 0;
+            trace_uvfs_requeue(trans);
+            spin_lock(&chan->reply_lock);
+            hlist_del_init(&trans->hash);
+            spin_unlock(&chan->reply_lock);
+        }
+    }
+    if (posted)
+    {
+        /* only the ring's owner can take it, not any reader of the shard */
+        if (posted > 1)
+            wake_up_interruptible(&shard->ring->wait);
+        spin_unlock(&shard->lock);
+    }
+    else
+    {
+        trans->queued = jiffies;
+        list_add_tail(&trans->list, &shard->requests[trans->prio]);
+        shard->queued++;
+        spin_unlock(&shard->lock);
+        /* an async request may be answered and freed by now */
+        uvfs_wake_daemon(chan, home);
+    }
+    return 0;
+}
+
+
+/*
+ * Coalescing.  A GETATTR or LOOKUP identical to one already sent, down
+ * to the credentials, waits for the reply to that one (its leader)
+ * instead of being sent itself.
+ */
+static inline int uvfs_coalescable(int type)
+{
+    return type == UVFS_GETATTR || type == UVFS_LOOKUP;
+}
+
+
+/* Everything after the generic header has to match. */
+
+static inline u32 uvfs_coalesce_key(uvfs_transaction_s* trans)
+{
+    uvfs_generic_req_s* req = &trans->u.request.generic;
+
+    return jhash((char*)req + sizeof(*req), req->size - sizeof(*req),
+                 req->type);
+}
+
+
+static inline int uvfs_same_request(uvfs_transaction_s* a,
+                                    uvfs_transaction_s* b)
+{
+    uvfs_generic_req_s* x = &a->u.request.generic;
+    uvfs_generic_req_s* y = &b->u.request.generic;
+
+    return x->type == y->type && x->size == y->size &&
+           !memcmp((char*)x + sizeof(*x), (char*)y + sizeof(*y),
+                   x->size - sizeof(*x));
+}
+
+
+/*
+ * Make trans follow an identical request that is still waiting for its
+ * reply, or make it the one others can follow.  Returns nonzero if trans
+ * is a follower and must not be sent.
+ */
+static int uvfs_coalesce(uvfs_transaction_s* trans)
+{
+    uvfs_channel_s* chan = trans->channel;
+    uvfs_transaction_s* leader;
+    struct hlist_head* bucket;
+    struct hlist_node* node;
+    u32 key = uvfs_coalesce_key(trans);
+
+    bucket = &chan->leaders[key & (UVFS_COALESCE_HASH_SIZE - 1)];
+    spin_lock(&chan->reply_lock);
+    hlist_for_each_entry(leader, node, bucket, coalesce)
+    {
+        /* a leader a daemon is handling, or already answered, takes
+           no new followers */
+        if (leader->state & (1UL << UVFS_TRANS_IN_USE |
+                             1UL << UVFS_TRANS_ANSWERED))
+        {
+            continue;
+        }
+        if (leader->key == key && uvfs_same_request(leader, trans))
+        {
+            list_add_tail(&trans->list, &leader->followers);
+            trans->leader = leader;
+            chan->coalesced++;
+            spin_unlock(&chan->reply_lock);
+            return 1;
+        }
+    }
+    trans->key = key;
+    hlist_add_head(&trans->coalesce, bucket);
+    spin_unlock(&chan->reply_lock);
+    return 0;
+}
+
+
+/*
+ * The leader trans has its final reply.  Give every follower a copy, or
+ * if the leader gave up, have the followers send their own requests.
+ */
+static void uvfs_release_followers(uvfs_transaction_s* trans)
+{
+    uvfs_channel_s* chan = trans->channel;
+    uvfs_transaction_s* follower;
+    uvfs_transaction_s* next;
+    int error = trans->u.reply.generic.error;
+    int retry = (error == -ERESTARTSYS || error == -ETIMEDOUT);
+
+    spin_lock(&chan->reply_lock);
+    hlist_del_init(&trans->coalesce);
+    list_for_each_entry_safe(follower, next, &trans->followers, list)
+    {
+        list_del_init(&follower->list);
+        follower->leader = NULL;
+        if (retry)
+        {
+            set_bit(UVFS_TRANS_RETRY, &follower->state);
+        }
+        else
+        {
+            memcpy(&follower->u, &trans->u, trans->capacity);
+            set_bit(UVFS_TRANS_ANSWERED, &follower->state);
+            trace_uvfs_wakeup(follower);
+        }
+        wake_up(&follower->fs_queue);
+    }
+    spin_unlock(&chan->reply_lock);
+}
+
+
+int uvfs_make_request(uvfs_transaction_s* trans)
+{
+    sigset_t oldset;
+    uvfs_channel_s* chan = trans->channel;
+    uvfs_shard_s* shard;
+    int type = trans->u.request.generic.type;
+    int coalesce = uvfs_coalescable(type);
+    int submitted = 0;
+    int expired;
+    int error = 0;
+    int sent = 0;
+
+    if (!coalesce || !uvfs_coalesce(trans))
+    {
+        if (uvfs_submit(trans))
+            goto out;
+        submitted = 1;
+    }
+    shard = &chan->shards[trans->shard];
+
+    uvfs_block_signals(&oldset);
+
+    /* Wait while the request is processed */
+    expired = uvfs_wait_reply(trans, type);
+    while (test_and_clear_bit(UVFS_TRANS_RETRY, &trans->state))
+    {
+        /* the leader we followed gave up, ask for ourselves */
+        if (uvfs_submit(trans))
+            goto restore;
+        submitted = 1;
+        shard = &chan->shards[trans->shard];
+        expired = uvfs_wait_reply(trans, type);
+    }
+
+    /* Check to see if we were interrupted by a signal or timed out */
+    spin_lock(&shard->lock);
+    spin_lock(&chan->reply_lock);
+    if (uvfs_killed())
+        error = -ERESTARTSYS;
+    else if (expired && !test_bit(UVFS_TRANS_ANSWERED, &trans->state))
+        error = -ETIMEDOUT;
+    if (error && trans->leader != NULL)
+    {
+        /* stop following, the leader carries on without us */
+        list_del_init(&trans->list);
+        trans->leader = NULL;
+        trans->u.reply.generic.error = error;
+    }
+    else if (error)
+    {
+        if (test_bit(UVFS_TRANS_IN_USE, &trans->state))
+        {
+            set_bit(UVFS_TRANS_ABORT, &trans->state);
+            spin_unlock(&chan->reply_lock);
+            spin_unlock(&shard->lock);
+            wait_event(trans->fs_queue,
+                       !test_bit(UVFS_TRANS_IN_USE, &trans->state));
+            spin_lock(&shard->lock);
+            spin_lock(&chan->reply_lock);
+        }
+        if (!list_empty(&trans->list))
+        {
+            list_del_init(&trans->list);
+            shard->queued--;
+        }
+        /* in the reply table means the daemon has seen it */
+        sent = !hlist_unhashed(&trans->hash);
+        hlist_del_init(&trans->hash);
+        trans->u.reply.generic.error = error;
+    }
+    spin_unlock(&chan->reply_lock);
+    spin_unlock(&shard->lock);
+    if (error)
+        trace_uvfs_abort(trans, error, sent);
+    if (submitted)
+        atomic_dec(&chan->pending);
+    if (!error)
+        uvfs_stats_record(type, trans);
+    if (error)
+    {
+        dprintk("<1>uvfs_make_request: %s %d %s\n", Op_names[type],
+                trans->serial,
+                error == -ETIMEDOUT ? "timed out" : "killed");
+        /* let the daemon stop working on it */
+        if (sent)
+            uvfs_post_cancel(chan, trans->serial);
+    }
+
+restore:
+    uvfs_restore_signals(&oldset);
+
+out:
+    if (coalesce)
+        uvfs_release_followers(trans);
+    return 0;
+}
+
+
+/*
+ * Send trans without waiting for the reply.  done is called from the
+ * pmfs workqueue once the reply, or an error in its place, is in trans,
+ * and owns trans from then on.  Callers that go away before the reply
+ * can't cancel.  The channel tick enforces the op_timeout deadline and
+ * the watchdog in their place.
+ */
+void uvfs_make_request_async(uvfs_transaction_s* trans,
+                             void (*done)(uvfs_transaction_s *))
+{
+    uvfs_channel_s* chan = trans->channel;
+    int type = trans->u.request.generic.type;
+    int tick;
+
+    trans->done = done;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+    INIT_WORK(&trans->work, uvfs_async_done);
+#else
+    INIT_WORK(&trans->work, uvfs_async_done, trans);
+#endif
+    if (type < ARRAY_SIZE(op_timeout) && op_timeout[type] > 0)
+        trans->deadline = jiffies + op_timeout[type] * HZ;
+    tick = trans->deadline != 0 || watchdog_secs > 0;
+    if (uvfs_submit(trans))
+    {
+        atomic_inc(&chan->pending);
+        uvfs_answer(trans);
+    }
+    else if (tick)
+    {
+        /* trans may be answered and freed by now */
+        queue_delayed_work(Uvfs_workqueue, &chan->tick, HZ);
+    }
+}
+
+
+/*
+ * Append a sub-request of the given type and size to the compound
+ * request in trans, whose header the caller has set up with no
+ * sub-requests yet.  Returns the sub-request with its generic header
+ * filled in, for the caller to fill in the rest, or NULL if it doesn't
+ * fit.
+ */
+void* uvfs_compound_add(uvfs_transaction_s* trans,
+                        int type,
+                        int size,
+                        unsigned flags)
+{
+    uvfs_compound_req_s* request = &trans->u.request.compound;
+    int used = request->size - offsetof(uvfs_compound_req_s, data);
+    uvfs_compound_op_s* op;
+    uvfs_generic_req_s* sub;
+
+    if (request->count >= UVFS_COMPOUND_MAX ||
+        used + sizeof(*op) + size > UVFS_COMPOUND_SIZE)
+    {
+        return NULL;
+    }
+    op = (uvfs_compound_op_s*)(request->data + used);
+    op->flags = flags;
+    sub = (uvfs_generic_req_s*)(op + 1);
+    sub->type = type;
+    sub->serial = request->serial;
+    sub->size = size;
+    request->count++;
+    request->size += UVFS_BATCH_ALIGN(sizeof(*op) + size);
+    return sub;
+}
+
+
+/*
+ * The reply to sub-request i of the compound request in trans, or NULL
+ * if it didn't run.  The daemon's packing is checked on the way, so the
+ * caller only has to check the size of the reply it gets.
+ */
+void* uvfs_compound_reply(uvfs_transaction_s* trans, unsigned i)
+{
+    uvfs_compound_rep_s* reply = &trans->u.reply.compound;
+    uvfs_generic_rep_s* sub;
+    int end, offset = 0;
+    unsigned n;
+
+    if (reply->error || i >= reply->count ||
+        reply->size > trans->capacity ||
+        reply->size < (int)offsetof(uvfs_compound_rep_s, data))
+    {
+        return NULL;
+    }
+    end = reply->size - offsetof(uvfs_compound_rep_s, data);
+    for (n = 0; ; n++)
+    {
+        /* sizes are signed, a negative one must not pass as huge */
+        if (offset + (int)sizeof(*sub) > end)
+            return NULL;
+        sub = (uvfs_generic_rep_s*)(reply->data + offset);
+        if (sub->size < (int)sizeof(*sub) || sub->size > end - offset)
+            return NULL;
+        if (n == i)
+            return sub;
+        offset += UVFS_BATCH_ALIGN(sub->size);
+    }
+}
+
+
+/*
+ * Transactions come in two size classes, each with its own slab cache.
+ * Metadata operations fit in the small class and never touch the
+ * page sized payload of reads and writes.
+ */
+#define UVFS_SMALL_PAYLOAD 1024
+#define UVFS_LARGE_PAYLOAD sizeof(((uvfs_transaction_s*)0)->u)
+#define UVFS_OP_SIZE(req, rep) \
+    (sizeof(req) > sizeof(rep) ? sizeof(req) : sizeof(rep))
+
+static const unsigned Op_sizes[] =
+{
+    [UVFS_WRITE]      = UVFS_OP_SIZE(uvfs_file_write_req_s, uvfs_file_write_rep_s),
+    [UVFS_READ]       = UVFS_OP_SIZE(uvfs_file_read_req_s, uvfs_file_read_rep_s),
+    [UVFS_CREATE]     = UVFS_OP_SIZE(uvfs_create_req_s, uvfs_create_rep_s),
+    [UVFS_LOOKUP]     = UVFS_OP_SIZE(uvfs_lookup_req_s, uvfs_lookup_rep_s),
+    [UVFS_UNLINK]     = UVFS_OP_SIZE(uvfs_unlink_req_s, uvfs_unlink_rep_s),
+    [UVFS_SYMLINK]    = UVFS_OP_SIZE(uvfs_symlink_req_s, uvfs_symlink_rep_s),
+    [UVFS_MKDIR]      = UVFS_OP_SIZE(uvfs_mkdir_req_s, uvfs_mkdir_rep_s),
+    [UVFS_RMDIR]      = UVFS_OP_SIZE(uvfs_rmdir_req_s, uvfs_rmdir_rep_s),
+    [UVFS_RENAME]     = UVFS_OP_SIZE(uvfs_rename_req_s, uvfs_rename_rep_s),
+    [UVFS_READDIR]    = UVFS_OP_SIZE(uvfs_readdir_req_s, uvfs_readdir_rep_s),
+    [UVFS_SETATTR]    = UVFS_OP_SIZE(uvfs_setattr_req_s, uvfs_setattr_rep_s),
+    [UVFS_GETATTR]    = UVFS_OP_SIZE(uvfs_getattr_req_s, uvfs_getattr_rep_s),
+    [UVFS_STATFS]     = UVFS_OP_SIZE(uvfs_statfs_req_s, uvfs_statfs_rep_s),
+    [UVFS_READ_SUPER] = UVFS_OP_SIZE(uvfs_read_super_req_s, uvfs_read_super_rep_s),
+    [UVFS_READLINK]   = UVFS_OP_SIZE(uvfs_readlink_req_s, uvfs_readlink_rep_s),
+    [UVFS_SHUTDOWN]   = UVFS_OP_SIZE(uvfs_shutdown_req_s, uvfs_shutdown_rep_s),
+    [UVFS_CANCEL]     = sizeof(uvfs_cancel_req_s),
+    [UVFS_COMPOUND]   = UVFS_OP_SIZE(uvfs_compound_req_s, uvfs_compound_rep_s),
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+static struct kmem_cache *uvfs_trans_small_cachep;
+static struct kmem_cache *uvfs_trans_large_cachep;
+#else
+static kmem_cache_t *uvfs_trans_small_cachep;
+static kmem_cache_t *uvfs_trans_large_cachep;
+#endif
+
+static int uvfs_init_transcache(void)
+{
+    size_t header = offsetof(uvfs_transaction_s, u);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+    uvfs_trans_small_cachep = kmem_cache_create("uvfs_trans_small",
+                                                header + UVFS_SMALL_PAYLOAD,
+                                                0, 0, NULL);
+    uvfs_trans_large_cachep = kmem_cache_create("uvfs_trans_large",
+                                                header + UVFS_LARGE_PAYLOAD,
+                                                0, 0, NULL);
+#else
+    uvfs_trans_small_cachep = kmem_cache_create("uvfs_trans_small",
+                                                header + UVFS_SMALL_PAYLOAD,
+                                                0, 0, NULL, NULL);
+    uvfs_trans_large_cachep = kmem_cache_create("uvfs_trans_large",
+                                                header + UVFS_LARGE_PAYLOAD,
+                                                0, 0, NULL, NULL);
+#endif
+    if (uvfs_trans_small_cachep == NULL || uvfs_trans_large_cachep == NULL)
+    {
+        if (uvfs_trans_small_cachep)
+            kmem_cache_destroy(uvfs_trans_small_cachep);
+        if (uvfs_trans_large_cachep)
+            kmem_cache_destroy(uvfs_trans_large_cachep);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void uvfs_destroy_transcache(void)
+{
+    kmem_cache_destroy(uvfs_trans_small_cachep);
+    kmem_cache_destroy(uvfs_trans_large_cachep);
+}
+
+
+/*
+ * size is the most bytes the request or reply will take, 0 for the size
+ * of the fixed layouts of type.  Transactions larger than the large
+ * class, such as multi-page reads, are vmalloced.
+ */
+static uvfs_transaction_s* uvfs_alloc_transaction(uvfs_channel_s* chan,
+                                                  int type,
+                                                  unsigned size)
+{
+    uvfs_transaction_s* trans;
+    int capacity = UVFS_LARGE_PAYLOAD;
+    dprintk("Entering uvfs_new_transaction\n");
+    if (size > UVFS_LARGE_PAYLOAD)
+    {
+        capacity = size;
+        trans = __vmalloc(offsetof(uvfs_transaction_s, u) + size,
+                          GFP_NOFS | __GFP_HIGHMEM, PAGE_KERNEL);
+    }
+    else if (type > 0 && type < ARRAY_SIZE(Op_sizes) &&
+             Op_sizes[type] <= UVFS_SMALL_PAYLOAD)
+    {
+        capacity = UVFS_SMALL_PAYLOAD;
+        trans = kmem_cache_alloc(uvfs_trans_small_cachep, GFP_NOFS);
+    }
+    else
+    {
+        trans = kmem_cache_alloc(uvfs_trans_large_cachep, GFP_NOFS);
+    }
+    if (trans == NULL)
+    {
+        dprintk("Exiting uvfs_new_transaction NULL\n");
+        return NULL;
+    }
+    trans->capacity = capacity;
+    trans->type = type;
+    trans->channel = chan;
+    trans->serial = atomic_inc_return(&chan->serial_number) - 1;
+    init_waitqueue_head(&trans->fs_queue);
+    INIT_LIST_HEAD(&trans->list);
+    INIT_HLIST_NODE(&trans->hash);
+    trans->shard = 0;
+    if (type == UVFS_READ || type == UVFS_WRITE)
+        trans->prio = UVFS_PRIO_DATA;
+    else
+        trans->prio = UVFS_PRIO_META;
+    trans->state = 0;
+    trans->noreply = 0;
+    trans->done = NULL;
+    trans->private = NULL;
+    trans->deadline = 0;
+    trans->pages = NULL;
+    trans->nr_pages = 0;
+    INIT_HLIST_NODE(&trans->coalesce);
+    INIT_LIST_HEAD(&trans->followers);
+    trans->leader = NULL;
+    trans->queued = jiffies;
+    trans->t_queued = 0;
+    trans->t_dequeued = 0;
+    trans->t_replied = 0;
+    dprintk("Issued serial = %d\n", trans->serial);
+    trace_uvfs_alloc(trans);
+    dprintk("Exiting uvfs_new_transaction\n");
+    return trans;
+}
+
+
+/*
+ * allocate a new tranaction request object and initialize it
+ * this object will need to be freed after the request is completed
+ * with uvfs_free_transaction
+ *
+ */
+uvfs_transaction_s* uvfs_new_transaction(struct super_block* sb, int type)
+{
+    return uvfs_alloc_transaction(UVFS_SB(sb)->channel, type, 0);
+}
+
+
+/* The same for a request or reply that may take up to size bytes. */
+
+uvfs_transaction_s* uvfs_new_transaction_size(struct super_block* sb,
+                                              int type,
+                                              unsigned size)
+{
+    return uvfs_alloc_transaction(UVFS_SB(sb)->channel, type, size);
+}
+
+
+void uvfs_free_transaction(uvfs_transaction_s* trans)
+{
+    if (trans->capacity == UVFS_SMALL_PAYLOAD)
+        kmem_cache_free(uvfs_trans_small_cachep, trans);
+    else if (trans->capacity > UVFS_LARGE_PAYLOAD)
+        vfree(trans);
+    else
+        kmem_cache_free(uvfs_trans_large_cachep, trans);
+}
+
+
+/*
+ * A mount binds to channel id for its lifetime.  Returns NULL if there
+ * is no such channel.
+ */
+uvfs_channel_s* uvfs_get_channel(int id)
+{
+    uvfs_channel_s* chan;
+
+    if (id < 0 || id >= UVFS_MAX_CHANNELS)
+        return NULL;
+    chan = Uvfs_channels[id];
+    spin_lock(&chan->lock);
+    chan->mounts++;
+    spin_unlock(&chan->lock);
+    return chan;
+}
+
+
+void uvfs_put_channel(uvfs_channel_s* chan)
+{
+    spin_lock(&chan->lock);
+    chan->mounts--;
+    spin_unlock(&chan->lock);
+}
+
+
+/*
+ * The limits and features negotiated on chan.  They can change when a
+ * daemon says hello, so read them once per request built.
+ */
+unsigned uvfs_max_read(uvfs_channel_s* chan)
+{
+    return ACCESS_ONCE(chan->max_read);
+}
+
+
+unsigned uvfs_max_write(uvfs_channel_s* chan)
+{
+    return ACCESS_ONCE(chan->max_write);
+}
+
+
+unsigned uvfs_channel_features(uvfs_channel_s* chan)
+{
+    return ACCESS_ONCE(chan->features);
+}
+
+
+/* Nothing is pending once the daemons are gone, so no tick rearms. */
+
+static void uvfs_stop_ticks(void)
+{
+    int i;
+    for (i = 0; i < UVFS_MAX_CHANNELS; i++)
+        cancel_delayed_work(&Uvfs_channels[i]->tick);
+    flush_workqueue(Uvfs_workqueue);
+}
+
+
+static void uvfs_destroy_channels(void)
+{
+    int i;
+    for (i = 0; i < UVFS_MAX_CHANNELS; i++)
+    {
+        kfree(Uvfs_channels[i]);
+        Uvfs_channels[i] = NULL;
+    }
+}
+
+
+static int uvfs_init_channels(void)
+{
+    uvfs_channel_s* chan;
+    int i, j, k;
+
+    for (i = 0; i < UVFS_MAX_CHANNELS; i++)
+    {
+        chan = kzalloc(sizeof(*chan) + Uvfs_nr_shards * sizeof(uvfs_shard_s),
+                       GFP_KERNEL);
+        if (chan == NULL)
+        {
+            uvfs_destroy_channels();
+            return -ENOMEM;
+        }
+        spin_lock_init(&chan->lock);
+        spin_lock_init(&chan->reply_lock);
+        chan->id = i;
+        uvfs_channel_defaults(chan);
+        atomic_set(&chan->serial_number, 0);
+        atomic_set(&chan->use_count, 0);
+        atomic_set(&chan->pending, 0);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+        INIT_DELAYED_WORK(&chan->tick, uvfs_channel_tick);
+#else
+        INIT_WORK(&chan->tick, uvfs_channel_tick, chan);
+#endif
+        for (j = 0; j < UVFS_REPLY_HASH_SIZE; j++)
+            INIT_HLIST_HEAD(&chan->replies[j]);
+        for (j = 0; j < UVFS_COALESCE_HASH_SIZE; j++)
+            INIT_HLIST_HEAD(&chan->leaders[j]);
+        for (j = 0; j < Uvfs_nr_shards; j++)
+        {
+            spin_lock_init(&chan->shards[j].lock);
+            for (k = 0; k < UVFS_NR_PRIOS; k++)
+                INIT_LIST_HEAD(&chan->shards[j].requests[k]);
+            init_waitqueue_head(&chan->shards[j].driver_queue);
+            chan->shards[j].ring = NULL;
+        }
+        Uvfs_channels[i] = chan;
+    }
+    return 0;
+}
+
+
+/*
+ * init pmfs driver, create /proc/fs/pmfs device node
+ * and register the pmfs file system type.
+ *
+ */
+static int __init uvfs_init(void)
+{
+    int result;
+
+    if (cpus_per_shard < 1)
+        cpus_per_shard = 1;
+    Uvfs_nr_shards = (num_possible_cpus() + cpus_per_shard - 1) / cpus_per_shard;
+    if (Uvfs_nr_shards > UVFS_MAX_SHARDS)
+        Uvfs_nr_shards = UVFS_MAX_SHARDS;
+    if (uvfs_init_channels())
+    {
+        return -ENOMEM;
+    }
+
+    dprintk("<1>uvfs_init(/proc/%s)\n", UVFS_PROC_NAME);
+
+    Uvfs_workqueue = create_workqueue(UVFS_MODULE_NAME);
+    if (Uvfs_workqueue == NULL)
+    {
+        uvfs_destroy_channels();
+        return -ENOMEM;
+    }
+    if (uvfs_init_transcache())
+    {
+        destroy_workqueue(Uvfs_workqueue);
+        uvfs_destroy_channels();
+        return -ENOMEM;
+    }
+    uvfs_proc_file = create_proc_entry(UVFS_PROC_NAME, S_IFREG | 0600, NULL);
+    if (uvfs_proc_file == NULL)
+    {
+        dprintk("<1>Could not create /proc/%s\n", UVFS_PROC_NAME);
+        uvfs_destroy_transcache();
+        destroy_workqueue(Uvfs_workqueue);
+        uvfs_destroy_channels();
+        return -EIO;
     }
     uvfs_proc_file->proc_fops = &Uvfsd_file_operations;
+    result = uvfs_init_stats();
+    if (result < 0)
+    {
+        remove_proc_entry(UVFS_PROC_NAME, NULL);
+        uvfs_destroy_transcache();
+        destroy_workqueue(Uvfs_workqueue);
+        uvfs_destroy_channels();
+        return result;
+    }
     result = register_filesystem(&Uvfs_file_system_type);
     if (result < 0)
     {
+        uvfs_destroy_stats();
         remove_proc_entry(UVFS_PROC_NAME, NULL);
+        uvfs_destroy_transcache();
+        destroy_workqueue(Uvfs_workqueue);
+        uvfs_destroy_channels();
         return result;
     }
     if (uvfs_init_inodecache())
@@ -465,8 +2757,13 @@ static void __exit uvfs_cleanup(void)
 {
     dprintk("<1>uvfs_cleanup(/proc/%s)\n", UVFS_PROC_NAME);
     unregister_filesystem(&Uvfs_file_system_type);
+    uvfs_destroy_stats();
     remove_proc_entry(UVFS_PROC_NAME, NULL);
     uvfs_destroy_inodecache();
+    uvfs_stop_ticks();
+    destroy_workqueue(Uvfs_workqueue);
+    uvfs_destroy_transcache();
+    uvfs_destroy_channels();
 }
 
 MODULE_LICENSE(UVFS_LICENSE);
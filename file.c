@@ -57,7 +57,8 @@ ssize_t uvfs_file_write(struct file* file,
     dprintk("<1>uvfs_file_write(%s/%s)\n",
             dentry->d_parent->d_name.name, dentry->d_name.name);
 
-    ret = uvfs_revalidate_inode(inode);
+    /* with unwritten data cached our size is the one that counts */
+    ret = uvfs_cached_writes(inode) ? 0 : uvfs_revalidate_inode(inode);
     if (!ret)
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
         return do_sync_write(file, buf, count, offset);
@@ -68,6 +69,57 @@ ssize_t uvfs_file_write(struct file* file,
 }
 
 
+/* woken when the last page of an inode comes out of writeback */
+static DECLARE_WAIT_QUEUE_HEAD(Uvfs_writeback_wait);
+
+
+/*
+ * Like filemap_write_and_wait, but only SIGKILL ends the wait for the
+ * WRITEs, with -EINTR, so a stuck daemon can't hold up close or a
+ * truncate for good.  The WRITEs end their writeback by themselves,
+ * at the latest when they time out or the channel fails them.
+ */
+static int uvfs_write_and_wait(struct address_space* mapping)
+{
+    atomic_t* writeback = &UVFS_I(mapping->host)->writeback;
+    int error;
+
+    error = filemap_fdatawrite(mapping);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,25)
+    if (wait_event_killable(Uvfs_writeback_wait,
+                            atomic_read(writeback) == 0))
+#else
+    if (wait_event_interruptible(Uvfs_writeback_wait,
+                                 atomic_read(writeback) == 0))
+#endif
+    {
+        return -EINTR;
+    }
+    /* the errors filemap_fdatawait would have reported */
+    if (test_and_clear_bit(AS_ENOSPC, &mapping->flags) && !error)
+        error = -ENOSPC;
+    if (test_and_clear_bit(AS_EIO, &mapping->flags) && !error)
+        error = -EIO;
+    return error;
+}
+
+
+/*
+ * Called on every close.  In write-back mode the dirty pages go out
+ * now, so the daemon has the data once close returns and a failed
+ * write is reported by close.
+ */
+int uvfs_file_flush(struct file* file, fl_owner_t id)
+{
+    struct inode* inode = file->f_dentry->d_inode;
+
+    if (!(file->f_mode & FMODE_WRITE) || !UVFS_SB(inode->i_sb)->writeback)
+        return 0;
+    dprintk("<1>uvfs_file_flush(%s)\n", file->f_dentry->d_name.name);
+    return uvfs_write_and_wait(inode->i_mapping);
+}
+
+
 int uvfs_file_mmap(struct file* file, struct vm_area_struct* vma)
 {
     struct dentry * dentry = file->f_dentry;
@@ -84,24 +136,24 @@ int uvfs_file_mmap(struct file* file, struct vm_area_struct* vma)
 }
 
 
-/* Called by page cache aware write functions. */
+/* Build a write request for count bytes at buff. */
 
-static int uvfs_write(struct inode* inode,
-                      const char* buff,
-                      unsigned offset,
-                      unsigned count)
+static uvfs_transaction_s* uvfs_write_request(struct inode* inode,
+                                              const char* buff,
+                                              unsigned offset,
+                                              unsigned count,
+                                              int prio)
 {
-    int error = 0;
     uvfs_file_write_req_s* request;
-    uvfs_file_write_rep_s* reply;
     uvfs_transaction_s* trans;
-    dprintk("<1>Entering uvfs_write offset=%d  count=%d\n", offset, count);
-    trans = uvfs_new_transaction();
+
+    trans = uvfs_new_transaction(inode->i_sb, UVFS_WRITE);
     if (trans == NULL)
     {
         dprintk("<1>uvfs_write: out of memory\n");
-        return -ENOMEM;
+        return NULL;
     }
+    trans->prio = prio;
     request = &trans->u.request.file_write;
     request->type = UVFS_WRITE;
     request->serial = trans->serial;
@@ -112,21 +164,85 @@ static int uvfs_write(struct inode* inode,
     request->count = count;
     request->offset = offset;
     memcpy(request->buff, buff, count);
+    return trans;
+}
+
+
+/* Called by page cache aware write functions. */
+
+static int uvfs_write(struct inode* inode,
+                      const char* buff,
+                      unsigned offset,
+                      unsigned count,
+                      int prio)
+{
+    int error = 0;
+    uvfs_file_write_rep_s* reply;
+    uvfs_transaction_s* trans;
+    dprintk("<1>Entering uvfs_write offset=%d  count=%d\n", offset, count);
+    trans = uvfs_write_request(inode, buff, offset, count, prio);
+    if (trans == NULL)
+    {
+        return -ENOMEM;
+    }
     uvfs_make_request(trans);
 
     reply = &trans->u.reply.file_write;
     error = reply->error;
 
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exited uvfs_write\n");
     return error;
 }
 
 
-/* Write out a page from an mmaped file. */
+/* pg goes under writeback until a WRITE of it is over. */
+
+static void uvfs_start_page_write(struct page* pg)
+{
+    atomic_inc(&UVFS_I(pg->mapping->host)->writeback);
+    set_page_writeback(pg);
+}
+
+
+/* The write of pg is over, record any error and end its writeback. */
+
+static void uvfs_end_page_write(struct page* pg, int error)
+{
+    struct inode* inode = pg->mapping->host;
+
+    if (error)
+    {
+        SetPageError(pg);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+        mapping_set_error(pg->mapping, error);
+#endif
+    }
+    end_page_writeback(pg);
+    if (atomic_dec_and_test(&UVFS_I(inode)->writeback))
+        wake_up_all(&Uvfs_writeback_wait);
+}
+
 
+/* An asynchronous page write is done. */
+
+static void uvfs_writepage_done(uvfs_transaction_s* trans)
+{
+    struct page* pg = trans->private;
+    int error = trans->u.reply.file_write.error;
+
+    uvfs_end_page_write(pg, error);
+    uvfs_free_transaction(trans);
+    dprintk("<1>Exited uvfs_writepage async err=%d\n", error);
+}
+
+
+/*
+ * Write out a page from an mmaped file.  Background writeback doesn't
+ * wait for the reply, so many pages can be in flight at once; the page
+ * stays under writeback until the reply comes in.
+ */
 int uvfs_writepage(struct page* pg, struct writeback_control *wbc)
-/* NOTE: need to add handling of writeback_control *wbc */
 {
     int err;
     struct inode* inode = pg->mapping->host;
@@ -134,6 +250,7 @@ int uvfs_writepage(struct page* pg, struct writeback_control *wbc)
     unsigned int end_index;
     unsigned offset;
     char* buff;
+    uvfs_transaction_s* trans = NULL;
 
     dprintk("<1>Entering uvfs_writepage\n");
     end_index = inode->i_size >> PAGE_CACHE_SHIFT;
@@ -153,7 +270,22 @@ int uvfs_writepage(struct page* pg, struct writeback_control *wbc)
     }
     offset = (pg->index << PAGE_CACHE_SHIFT);
     buff = kmap(pg);
-    err = uvfs_write(inode, buff, offset, count);
+    if (wbc->sync_mode == WB_SYNC_NONE)
+    {
+        trans = uvfs_write_request(inode, buff, offset, count,
+                                   UVFS_PRIO_BACKGROUND);
+    }
+    if (trans != NULL)
+    {
+        kunmap(pg);
+        uvfs_start_page_write(pg);
+        SetPageUptodate(pg);
+        unlock_page(pg);
+        trans->private = pg;
+        uvfs_make_request_async(trans, uvfs_writepage_done);
+        return 0;
+    }
+    err = uvfs_write(inode, buff, offset, count, UVFS_PRIO_BACKGROUND);
     kunmap(pg);
     if(err)
         SetPageError(pg);
@@ -165,22 +297,99 @@ int uvfs_writepage(struct page* pg, struct writeback_control *wbc)
 }
 
 
+/*
+ * Bytes of data in a successful READ reply, no more than were asked
+ * for or actually came in with the reply.
+ */
+static int uvfs_read_bytes(uvfs_file_read_rep_s* reply, int count)
+{
+    int bytes = reply->bytes_read;
+
+    if (bytes > reply->size - (int)offsetof(uvfs_file_read_rep_s, buff))
+        bytes = reply->size - offsetof(uvfs_file_read_rep_s, buff);
+    if (bytes > count)
+        bytes = count;
+    return bytes < 0 ? 0 : bytes;
+}
+
+
+/*
+ * Fill pg with count bytes of data, zero the rest and unlock it.  With
+ * data NULL the reply already put the count bytes in the page.
+ */
+static void uvfs_fill_page(struct page* pg, const char* data, int count)
+{
+    char* buff;
+
+    buff = kmap(pg);
+    if (data != NULL)
+        memcpy(buff, data, count);
+    if (count < PAGE_CACHE_SIZE)
+        memset(buff + count, 0, PAGE_CACHE_SIZE - count);
+    kunmap(pg);
+    flush_dcache_page(pg);
+    SetPageUptodate(pg);
+    unlock_page(pg);
+}
+
+
+/* the pages of a READ or WRITE in flight, for its completion */
+typedef struct _uvfs_pages_s
+{
+    unsigned nr;
+    struct page* pages[0];
+} uvfs_pages_s;
+
+
+/* The reply to a page read is in, finish the page and unlock it. */
+
+static void uvfs_readpage_done(uvfs_transaction_s* trans)
+{
+    struct page* pg = trans->page;
+    uvfs_file_read_rep_s* reply = &trans->u.reply.file_read;
+    int count = 0;
+
+    if (reply->error >= 0)
+        count = uvfs_read_bytes(reply, PAGE_CACHE_SIZE);
+    /* a short reply before i_size is no EOF, don't cache zeroes for it */
+    if (reply->error >= 0 && count < PAGE_CACHE_SIZE &&
+        ((loff_t)pg->index << PAGE_CACHE_SHIFT) + count <
+        pg->mapping->host->i_size)
+    {
+        reply->error = -EIO;
+    }
+    /* Q? should we fill in the page if there was an error? */
+    if (reply->error < 0)
+    {
+        SetPageError(pg);
+        flush_dcache_page(pg);
+        unlock_page(pg);
+        dprintk("<1>Exited readpage error=%d\n", reply->error);
+        uvfs_free_transaction(trans);
+        return;
+    }
+    uvfs_fill_page(pg, NULL, count);
+    uvfs_free_transaction(trans);
+    dprintk("<1>Exited uvfs_readpage OK\n");
+}
+
+
 /* Read a page of an mmaped file.  Any data in the page beyond EOF should
-   be NULLed. */
+   be NULLed.  The page is unlocked when the reply comes in, so readahead
+   keeps several reads in flight.  The daemon's data is copied straight
+   into the page. */
 
 int uvfs_readpage(struct file* filp, struct page* pg)
 {
-    int error = 0;
     struct inode* inode = pg->mapping->host;
-    char* buff;
     uvfs_file_read_req_s* request;
-    uvfs_file_read_rep_s* reply;
     uvfs_transaction_s* trans;
 
     dprintk("<1>Entering uvfs_readpage\n");
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(inode->i_sb, UVFS_READ);
     if (trans == NULL)
     {
+        unlock_page(pg);
         return -ENOMEM;
     }
     request = &trans->u.request.file_read;
@@ -192,40 +401,517 @@ int uvfs_readpage(struct file* filp, struct page* pg)
     request->fh = UVFS_I(inode)->fh;
     request->count = PAGE_CACHE_SIZE;
     request->offset = pg->index << PAGE_CACHE_SHIFT;
-    uvfs_make_request(trans);
+    trans->page = pg;
+    trans->pages = &trans->page;
+    trans->nr_pages = 1;
+    uvfs_make_request_async(trans, uvfs_readpage_done);
+    return 0;
+}
 
-    reply = &trans->u.reply.file_read;
-    /* Q? should we fill in the page if there was an error? */
-    if (reply->error < 0)
+/*
+ * Readahead.  Runs of consecutive pages go to the daemon in one READ of
+ * up to the max_read of the channel.  The pages stay locked until the
+ * reply has been copied into them; if the read fails, or comes back
+ * short before EOF, they are left for readpage to retry and report.
+ */
+typedef struct _uvfs_read_batch_s
+{
+    struct inode* inode;
+    unsigned max_pages;
+    unsigned nr;
+    struct page* pages[UVFS_MAX_READ_PAGES];
+} uvfs_read_batch_s;
+
+
+static void uvfs_readpages_done(uvfs_transaction_s* trans)
+{
+    uvfs_pages_s* rp = trans->private;
+    uvfs_file_read_rep_s* reply = &trans->u.reply.file_read;
+    loff_t isize = rp->pages[0]->mapping->host->i_size;
+    loff_t pos;
+    int bytes = 0;
+    int count;
+    unsigned i;
+
+    if (reply->error >= 0)
+        bytes = uvfs_read_bytes(reply, rp->nr << PAGE_CACHE_SHIFT);
+    for (i = 0; i < rp->nr; i++)
     {
-        error = reply->error;
-        goto err;
+        if (reply->error < 0)
+        {
+            unlock_page(rp->pages[i]);
+            continue;
+        }
+        count = bytes - (i << PAGE_CACHE_SHIFT);
+        if (count > PAGE_CACHE_SIZE)
+            count = PAGE_CACHE_SIZE;
+        if (count < 0)
+            count = 0;
+        /* a short reply is only EOF if the data got to i_size */
+        pos = ((loff_t)rp->pages[i]->index << PAGE_CACHE_SHIFT) + count;
+        if (count < PAGE_CACHE_SIZE && pos < isize)
+        {
+            unlock_page(rp->pages[i]);
+            continue;
+        }
+        uvfs_fill_page(rp->pages[i], NULL, count);
     }
-    buff = kmap(pg);
-    memcpy(buff, reply->buff, reply->bytes_read);
-    if (reply->bytes_read < PAGE_CACHE_SIZE)
+    dprintk("<1>Exited uvfs_readpages %u pages error=%d\n",
+            rp->nr, reply->error);
+    kfree(rp);
+    uvfs_free_transaction(trans);
+}
+
+
+static void uvfs_read_batch_send(uvfs_read_batch_s* batch)
+{
+    struct inode* inode = batch->inode;
+    unsigned count = batch->nr << PAGE_CACHE_SHIFT;
+    uvfs_file_read_req_s* request;
+    uvfs_transaction_s* trans;
+    uvfs_pages_s* rp;
+    unsigned i;
+
+    rp = kmalloc(sizeof(*rp) + batch->nr * sizeof(struct page*), GFP_NOFS);
+    trans = uvfs_new_transaction(inode->i_sb, UVFS_READ);
+    if (rp == NULL || trans == NULL)
     {
-        memset(buff + reply->bytes_read, 0,
-               PAGE_CACHE_SIZE - reply->bytes_read);
+        kfree(rp);
+        if (trans != NULL)
+            uvfs_free_transaction(trans);
+        for (i = 0; i < batch->nr; i++)
+            unlock_page(batch->pages[i]);
+        batch->nr = 0;
+        return;
     }
-    kunmap(pg);
-    flush_dcache_page(pg);
+    request = &trans->u.request.file_read;
+    request->type = UVFS_READ;
+    request->serial = trans->serial;
+    request->size = sizeof(*request);
+    request->uid = current_fsuid();
+    request->gid = current_fsgid();
+    request->fh = UVFS_I(inode)->fh;
+    request->count = count;
+    request->offset = batch->pages[0]->index << PAGE_CACHE_SHIFT;
+    rp->nr = batch->nr;
+    memcpy(rp->pages, batch->pages, batch->nr * sizeof(struct page*));
+    batch->nr = 0;
+    trans->private = rp;
+    trans->pages = rp->pages;
+    trans->nr_pages = rp->nr;
+    uvfs_make_request_async(trans, uvfs_readpages_done);
+}
+
+
+/* Called by read_cache_pages for each page, locked in the page cache. */
+
+static int uvfs_readpages_filler(void* data, struct page* pg)
+{
+    uvfs_read_batch_s* batch = data;
+
+    if (batch->nr > 0 &&
+        (batch->nr == batch->max_pages ||
+         pg->index != batch->pages[0]->index + batch->nr))
+    {
+        uvfs_read_batch_send(batch);
+    }
+    batch->pages[batch->nr++] = pg;
+    return 0;
+}
+
+
+int uvfs_readpages(struct file* filp,
+                   struct address_space* mapping,
+                   struct list_head* pages,
+                   unsigned nr_pages)
+{
+    struct inode* inode = mapping->host;
+    uvfs_read_batch_s batch;
+    int error;
+
+    dprintk("<1>Entering uvfs_readpages %u pages\n", nr_pages);
+    batch.inode = inode;
+    batch.max_pages =
+        uvfs_max_read(UVFS_SB(inode->i_sb)->channel) >> PAGE_CACHE_SHIFT;
+    if (batch.max_pages > UVFS_MAX_READ_PAGES)
+        batch.max_pages = UVFS_MAX_READ_PAGES;
+    if (batch.max_pages == 0)
+        batch.max_pages = 1;
+    batch.nr = 0;
+    error = read_cache_pages(mapping, pages, uvfs_readpages_filler, &batch);
+    if (batch.nr > 0)
+        uvfs_read_batch_send(&batch);
+    return error;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+
+/*
+ * Writeback.  Runs of consecutive dirty pages go to the daemon in one
+ * WRITE of up to the max_write of the channel.  Each page is under
+ * writeback, unlocked, from the time it joins a run until the reply is
+ * in.  Nothing waits for the reply here: a data integrity sync waits on
+ * the writeback of the pages after writepages returns.
+ */
+typedef struct _uvfs_write_batch_s
+{
+    struct inode* inode;
+    struct writeback_control* wbc;
+    unsigned max_pages;
+    unsigned nr;
+    unsigned count;
+    struct page* pages[UVFS_MAX_WRITE_PAGES];
+} uvfs_write_batch_s;
+
+
+static void uvfs_writepages_done(uvfs_transaction_s* trans)
+{
+    uvfs_pages_s* rp = trans->private;
+    int error = trans->u.reply.file_write.error;
+    unsigned i;
+
+    for (i = 0; i < rp->nr; i++)
+        uvfs_end_page_write(rp->pages[i], error);
+    dprintk("<1>Exited uvfs_writepages %u pages error=%d\n", rp->nr, error);
+    kfree(rp);
+    uvfs_free_transaction(trans);
+}
+
+
+static int uvfs_write_batch_send(uvfs_write_batch_s* batch)
+{
+    struct inode* inode = batch->inode;
+    uvfs_file_write_req_s* request;
+    uvfs_transaction_s* trans;
+    uvfs_pages_s* rp;
+    unsigned count;
+    unsigned i;
+    char* buff;
+
+    rp = kmalloc(sizeof(*rp) + batch->nr * sizeof(struct page*), GFP_NOFS);
+    trans = uvfs_new_transaction_size(inode->i_sb, UVFS_WRITE,
+                                      offsetof(uvfs_file_write_req_s, buff) +
+                                      batch->count);
+    if (rp == NULL || trans == NULL)
+    {
+        /* leave the pages dirty for the next round of writeback */
+        kfree(rp);
+        if (trans != NULL)
+            uvfs_free_transaction(trans);
+        for (i = 0; i < batch->nr; i++)
+        {
+            redirty_page_for_writepage(batch->wbc, batch->pages[i]);
+            uvfs_end_page_write(batch->pages[i], 0);
+        }
+        batch->nr = 0;
+        batch->count = 0;
+        return -ENOMEM;
+    }
+    trans->prio = batch->wbc->sync_mode == WB_SYNC_NONE ?
+        UVFS_PRIO_BACKGROUND : UVFS_PRIO_DATA;
+    request = &trans->u.request.file_write;
+    request->type = UVFS_WRITE;
+    request->serial = trans->serial;
+    request->size = offsetof(uvfs_file_write_req_s, buff) + batch->count;
+    request->uid = current_fsuid();
+    request->gid = current_fsgid();
+    request->fh = UVFS_I(inode)->fh;
+    request->count = batch->count;
+    request->offset = batch->pages[0]->index << PAGE_CACHE_SHIFT;
+    for (i = 0; i < batch->nr; i++)
+    {
+        count = batch->count - (i << PAGE_CACHE_SHIFT);
+        if (count > PAGE_CACHE_SIZE)
+            count = PAGE_CACHE_SIZE;
+        buff = kmap(batch->pages[i]);
+        memcpy(request->buff + (i << PAGE_CACHE_SHIFT), buff, count);
+        kunmap(batch->pages[i]);
+    }
+    rp->nr = batch->nr;
+    memcpy(rp->pages, batch->pages, batch->nr * sizeof(struct page*));
+    batch->nr = 0;
+    batch->count = 0;
+    trans->private = rp;
+    uvfs_make_request_async(trans, uvfs_writepages_done);
+    return 0;
+}
+
+
+/*
+ * Called by write_cache_pages for each dirty page, locked and already
+ * cleaned for io.  A page that ends short of a full page, at EOF, ends
+ * its run.
+ */
+static int uvfs_writepages_callback(struct page* pg,
+                                    struct writeback_control* wbc,
+                                    void* data)
+{
+    uvfs_write_batch_s* batch = data;
+    struct inode* inode = batch->inode;
+    unsigned end_index;
+    unsigned count;
+    int error;
+
+    end_index = inode->i_size >> PAGE_CACHE_SHIFT;
+    if (pg->index < end_index)
+    {
+        count = PAGE_CACHE_SIZE;
+    }
+    else
+    {
+        count = inode->i_size & (PAGE_CACHE_SIZE - 1);
+        if (pg->index > end_index || count == 0)
+        {
+            unlock_page(pg);
+            return 0;
+        }
+    }
+    if (batch->nr > 0 &&
+        (batch->nr == batch->max_pages ||
+         pg->index != batch->pages[0]->index + batch->nr ||
+         (batch->count & (PAGE_CACHE_SIZE - 1)) != 0))
+    {
+        error = uvfs_write_batch_send(batch);
+        if (error)
+        {
+            redirty_page_for_writepage(wbc, pg);
+            unlock_page(pg);
+            return error;
+        }
+    }
+    uvfs_start_page_write(pg);
     SetPageUptodate(pg);
     unlock_page(pg);
-    kfree(trans);
-    dprintk("<1>Exited uvfs_readpage OK\n");
+    batch->pages[batch->nr++] = pg;
+    batch->count += count;
     return 0;
-err:
-    SetPageError(pg);
-    flush_dcache_page(pg);
-    unlock_page(pg);
-    kfree(trans);
-    dprintk("<1>Exited readpage error=%d\n", error);
+}
+
+
+int uvfs_writepages(struct address_space* mapping,
+                    struct writeback_control* wbc)
+{
+    struct inode* inode = mapping->host;
+    uvfs_write_batch_s batch;
+    int error;
+    int err;
+
+    dprintk("<1>Entering uvfs_writepages sync=%d\n", wbc->sync_mode);
+    batch.inode = inode;
+    batch.wbc = wbc;
+    batch.max_pages =
+        uvfs_max_write(UVFS_SB(inode->i_sb)->channel) >> PAGE_CACHE_SHIFT;
+    if (batch.max_pages > UVFS_MAX_WRITE_PAGES)
+        batch.max_pages = UVFS_MAX_WRITE_PAGES;
+    if (batch.max_pages == 0)
+        batch.max_pages = 1;
+    batch.nr = 0;
+    batch.count = 0;
+    error = write_cache_pages(mapping, wbc, uvfs_writepages_callback, &batch);
+    if (batch.nr > 0)
+    {
+        err = uvfs_write_batch_send(&batch);
+        if (error == 0)
+            error = err;
+    }
     return error;
 }
 
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24) */
+
+
+/*
+ * O_DIRECT.  Data moves between the user buffer and the daemon in
+ * READs and WRITEs of up to the max_read and max_write of the channel,
+ * without going through the page cache.  The VFS writes back and drops
+ * cached pages of the range around the call.
+ */
+static ssize_t uvfs_direct_read(struct inode* inode,
+                                char __user* buf,
+                                loff_t pos,
+                                size_t len)
+{
+    unsigned max = uvfs_max_read(UVFS_SB(inode->i_sb)->channel);
+    uvfs_file_read_req_s* request;
+    uvfs_file_read_rep_s* reply;
+    uvfs_transaction_s* trans;
+    ssize_t done = 0;
+    unsigned count;
+    int bytes;
+    int error = 0;
+
+    while (len > 0)
+    {
+        count = len < max ? len : max;
+        trans = uvfs_new_transaction_size(inode->i_sb, UVFS_READ,
+                                          offsetof(uvfs_file_read_rep_s, buff) +
+                                          count);
+        if (trans == NULL)
+        {
+            error = -ENOMEM;
+            break;
+        }
+        request = &trans->u.request.file_read;
+        request->type = UVFS_READ;
+        request->serial = trans->serial;
+        request->size = sizeof(*request);
+        request->uid = current_fsuid();
+        request->gid = current_fsgid();
+        request->fh = UVFS_I(inode)->fh;
+        request->count = count;
+        request->offset = pos;
+        uvfs_make_request(trans);
+
+        reply = &trans->u.reply.file_read;
+        error = reply->error;
+        bytes = error < 0 ? 0 : uvfs_read_bytes(reply, count);
+        if (bytes > 0 && copy_to_user(buf, reply->buff, bytes))
+            error = -EFAULT;
+        uvfs_free_transaction(trans);
+        if (error < 0)
+            break;
+        done += bytes;
+        buf += bytes;
+        pos += bytes;
+        len -= bytes;
+        /* a short read is EOF only at i_size, else ask for the rest */
+        if (bytes == 0 || (bytes < count && pos >= inode->i_size))
+            break;
+    }
+    return done ? done : error;
+}
+
+
+static ssize_t uvfs_direct_write(struct inode* inode,
+                                 const char __user* buf,
+                                 loff_t pos,
+                                 size_t len)
+{
+    unsigned max = uvfs_max_write(UVFS_SB(inode->i_sb)->channel);
+    uvfs_file_write_req_s* request;
+    uvfs_transaction_s* trans;
+    ssize_t done = 0;
+    unsigned count;
+    int error = 0;
+
+    while (len > 0)
+    {
+        count = len < max ? len : max;
+        trans = uvfs_new_transaction_size(inode->i_sb, UVFS_WRITE,
+                                          offsetof(uvfs_file_write_req_s, buff) +
+                                          count);
+        if (trans == NULL)
+        {
+            error = -ENOMEM;
+            break;
+        }
+        request = &trans->u.request.file_write;
+        request->type = UVFS_WRITE;
+        request->serial = trans->serial;
+        request->size = offsetof(uvfs_file_write_req_s, buff) + count;
+        request->uid = current_fsuid();
+        request->gid = current_fsgid();
+        request->fh = UVFS_I(inode)->fh;
+        request->count = count;
+        request->offset = pos;
+        if (copy_from_user(request->buff, buf, count))
+        {
+            uvfs_free_transaction(trans);
+            error = -EFAULT;
+            break;
+        }
+        uvfs_make_request(trans);
+
+        /* like uvfs_write, a WRITE without error wrote it all */
+        error = trans->u.reply.file_write.error;
+        uvfs_free_transaction(trans);
+        if (error < 0)
+            break;
+        done += count;
+        buf += count;
+        pos += count;
+        len -= count;
+    }
+    return done ? done : error;
+}
+
+
+ssize_t uvfs_direct_IO(int rw,
+                       struct kiocb* iocb,
+                       const struct iovec* iov,
+                       loff_t offset,
+                       unsigned long nr_segs)
+{
+    struct inode* inode = iocb->ki_filp->f_mapping->host;
+    ssize_t done = 0;
+    ssize_t ret = 0;
+    unsigned long seg;
+
+    dprintk("<1>Entering uvfs_direct_IO rw=%d offset=%lld segs=%lu\n",
+            rw, (long long)offset, nr_segs);
+    for (seg = 0; seg < nr_segs; seg++)
+    {
+        if (rw == WRITE)
+            ret = uvfs_direct_write(inode, iov[seg].iov_base,
+                                    offset, iov[seg].iov_len);
+        else
+            ret = uvfs_direct_read(inode, iov[seg].iov_base,
+                                   offset, iov[seg].iov_len);
+        if (ret <= 0)
+            break;
+        done += ret;
+        offset += ret;
+        if (ret < iov[seg].iov_len)
+            break;
+    }
+    dprintk("<1>Exited uvfs_direct_IO %zd\n", done ? done : ret);
+    return done ? done : ret;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
 
+/*
+ * In write-back mode a page only partly written must hold valid data
+ * around the write, since all of it goes out later.  Past EOF that is
+ * zeroes, otherwise the page is read in first.  The page stays locked,
+ * unless it was truncated while we read it, which gives -EAGAIN.
+ */
+static int uvfs_write_prepare_page(struct file* file,
+                                   struct address_space* mapping,
+                                   struct page* page,
+                                   unsigned from,
+                                   unsigned to)
+{
+    struct inode* inode = mapping->host;
+    char* kaddr;
+    int error;
+
+    if (PageUptodate(page) || (from == 0 && to == PAGE_CACHE_SIZE))
+        return 0;
+    if (((loff_t)page->index << PAGE_CACHE_SHIFT) >= inode->i_size)
+    {
+        kaddr = kmap_atomic(page, KM_USER0);
+        memset(kaddr, 0, from);
+        memset(kaddr + to, 0, PAGE_CACHE_SIZE - to);
+        flush_dcache_page(page);
+        kunmap_atomic(kaddr, KM_USER0);
+        return 0;
+    }
+    /* uvfs_readpage unlocks the page once the data is in */
+    error = uvfs_readpage(file, page);
+    lock_page(page);
+    if (page->mapping != mapping)
+    {
+        unlock_page(page);
+        return -EAGAIN;
+    }
+    if (error == 0 && !PageUptodate(page))
+        error = -EIO;
+    if (error)
+        unlock_page(page);
+    return error;
+}
+
 int uvfs_write_begin(struct file *file, struct address_space *mapping,
                      loff_t pos, unsigned len, unsigned flags,
                      struct page **pagep, void **fsdata)
@@ -233,25 +919,77 @@ int uvfs_write_begin(struct file *file, struct address_space *mapping,
     struct page *page;
     pgoff_t index;
     unsigned from;
+    int error;
 
     index = pos >> PAGE_CACHE_SHIFT;
     from = pos & (PAGE_CACHE_SIZE - 1);
 
+again:
     page = grab_cache_page_write_begin(mapping, index, flags);
     if (!page)
         return -ENOMEM;
 
+    if (UVFS_SB(mapping->host->i_sb)->writeback)
+    {
+        error = uvfs_write_prepare_page(file, mapping, page, from, from+len);
+        if (error)
+        {
+            page_cache_release(page);
+            if (error == -EAGAIN)
+                goto again;
+            return error;
+        }
+    }
+
     *pagep = page;
 
     return uvfs_prepare_write(file, page, from, from+len);
 }
 
+/*
+ * Write-back mode: leave the data dirty in the page cache for
+ * writepages.  A short copy into a page that is not uptodate only
+ * keeps what it got if the page is past EOF and zeroed around it.
+ */
+static unsigned uvfs_write_cached(struct inode* inode, struct page* page,
+                                  loff_t pos, unsigned len, unsigned copied)
+{
+    unsigned from = pos & (PAGE_CACHE_SIZE - 1);
+    char* kaddr;
+
+    if (!PageUptodate(page))
+    {
+        if (copied < len)
+        {
+            if (len == PAGE_CACHE_SIZE)
+                return 0;
+            kaddr = kmap_atomic(page, KM_USER0);
+            memset(kaddr + from + copied, 0, len - copied);
+            flush_dcache_page(page);
+            kunmap_atomic(kaddr, KM_USER0);
+        }
+        SetPageUptodate(page);
+    }
+    set_page_dirty(page);
+    if (pos + copied > inode->i_size)
+        inode->i_size = pos + copied;
+    return copied;
+}
+
 int uvfs_write_end(struct file *file, struct address_space *mapping,
                    loff_t pos, unsigned len, unsigned copied,
                    struct page *page, void *fsdata)
 {
     unsigned from = pos & (PAGE_CACHE_SIZE - 1);
 
+    if (UVFS_SB(mapping->host->i_sb)->writeback)
+    {
+        copied = uvfs_write_cached(mapping->host, page, pos, len, copied);
+        unlock_page(page);
+        page_cache_release(page);
+        return copied;
+    }
+
     /* zero the stale part of the page if we did a short copy */
     if (copied < len) {
             void *kaddr = kmap_atomic(page, KM_USER0);
@@ -297,7 +1035,7 @@ int uvfs_commit_write(struct file* filp, struct page* pg,
     count = to - offset;
     off = (pg->index << PAGE_CACHE_SHIFT) + offset;
     buff = kmap(pg);
-    retval = uvfs_write(inode, buff + offset, off, count);
+    retval = uvfs_write(inode, buff + offset, off, count, UVFS_PRIO_DATA);
     pos = (pg->index << PAGE_CACHE_SHIFT) + to;
     if (pos > inode->i_size)
     {
@@ -320,8 +1058,11 @@ int uvfs_setattr(struct dentry* entry, struct iattr* attr)
     int error = 0;
     struct inode* inode;
     unsigned int oldflags;
+    int compound;
     uvfs_setattr_req_s* request;
     uvfs_setattr_rep_s* reply;
+    uvfs_getattr_req_s* getattr;
+    uvfs_getattr_rep_s* attrs;
     uvfs_transaction_s* trans;
     dprintk("<1>Entered uvfs_setattr pid=%d\n", current->pid);
     inode = entry->d_inode;
@@ -341,6 +1082,13 @@ int uvfs_setattr(struct dentry* entry, struct iattr* attr)
        vmtruncate) we get an inconsistent page cache for the file.
        fsx will turn this up.
     */
+    /* cached writes must not land after, and undo, a size change */
+    if ((attr->ia_valid & ATTR_SIZE) && UVFS_SB(inode->i_sb)->writeback)
+    {
+        error = uvfs_write_and_wait(inode->i_mapping);
+        if (error)
+            return error;
+    }
     oldflags = attr->ia_valid;
     attr->ia_valid &= ~(ATTR_ATIME|ATTR_MTIME|ATTR_CTIME);
     if (inode_setattr(inode, attr))
@@ -351,16 +1099,32 @@ int uvfs_setattr(struct dentry* entry, struct iattr* attr)
     attr->ia_valid = oldflags;
     dprintk("uvfs_setattr: %s  mode %o\n", entry->d_name.name, attr->ia_mode);
 
-    trans = uvfs_new_transaction();
+    /* fetch the new attributes in the same round trip if we can */
+    compound = uvfs_channel_features(UVFS_SB(inode->i_sb)->channel) &
+               UVFS_FEATURE_COMPOUND;
+    trans = uvfs_new_transaction(inode->i_sb,
+                                 compound ? UVFS_COMPOUND : UVFS_SETATTR);
     if (trans == 0)
     {
         dprintk("<1>uvfs_setattr: out of memory\n");
         return -ENOMEM;
     }
-    request = &trans->u.request.setattr;
-    request->type = UVFS_SETATTR;
-    request->serial = trans->serial;
-    request->size = sizeof(*request);
+    if (compound)
+    {
+        trans->u.request.compound.type = UVFS_COMPOUND;
+        trans->u.request.compound.serial = trans->serial;
+        trans->u.request.compound.size =
+            offsetof(uvfs_compound_req_s, data);
+        trans->u.request.compound.count = 0;
+        request = uvfs_compound_add(trans, UVFS_SETATTR, sizeof(*request), 0);
+    }
+    else
+    {
+        request = &trans->u.request.setattr;
+        request->type = UVFS_SETATTR;
+        request->serial = trans->serial;
+        request->size = sizeof(*request);
+    }
     request->uid = current_fsuid();
     request->gid = current_fsgid();
     request->fh = UVFS_I(inode)->fh;
@@ -375,12 +1139,35 @@ int uvfs_setattr(struct dentry* entry, struct iattr* attr)
     request->ia_mtime.tv_nsec = attr->ia_mtime.tv_nsec;
     request->ia_ctime.tv_sec = attr->ia_ctime.tv_sec;
     request->ia_ctime.tv_nsec = attr->ia_ctime.tv_nsec;
+    if (compound)
+    {
+        getattr = uvfs_compound_add(trans, UVFS_GETATTR, sizeof(*getattr), 0);
+        getattr->uid = current_fsuid();
+        getattr->gid = current_fsgid();
+        getattr->fh = UVFS_I(inode)->fh;
+    }
     uvfs_make_request(trans);
 
-    reply = &trans->u.reply.setattr;
-    error = reply->error;
+    if (compound)
+    {
+        reply = uvfs_compound_reply(trans, 0);
+        error = reply ? reply->error : trans->u.reply.compound.error;
+        if (error == 0 && reply == NULL)
+            error = -EIO;
+        attrs = uvfs_compound_reply(trans, 1);
+        if (error == 0 && attrs != NULL && attrs->error == 0 &&
+            attrs->size >= (int)sizeof(*attrs))
+        {
+            uvfs_refresh_inode(inode, &attrs->a);
+        }
+    }
+    else
+    {
+        reply = &trans->u.reply.setattr;
+        error = reply->error;
+    }
 
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exiting uvfs_setattr: error %d\n", error);
     return error;
 }
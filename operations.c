@@ -29,6 +29,7 @@ struct file_operations Uvfs_file_file_operations =
     .write          = uvfs_file_write,
     .mmap           = uvfs_file_mmap,
     .open           = generic_file_open,
+    .flush          = uvfs_file_flush,
     .fsync          = file_fsync,
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
     .aio_read       = generic_file_aio_read,
@@ -40,6 +41,11 @@ struct address_space_operations Uvfs_file_aops =
 {
     .writepage      = uvfs_writepage,
     .readpage       = uvfs_readpage,
+    .readpages      = uvfs_readpages,
+    .direct_IO      = uvfs_direct_IO,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
+    .writepages     = uvfs_writepages,
+#endif
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
     .write_begin    = uvfs_write_begin,
     .write_end      = uvfs_write_end,
@@ -115,5 +121,5 @@ struct file_system_type Uvfs_file_system_type =
     .owner          = THIS_MODULE,
     .name           = UVFS_MODULE_NAME,
     .get_sb         = uvfs_get_sb,
-    .kill_sb        = kill_anon_super,
+    .kill_sb        = uvfs_kill_sb,
 };
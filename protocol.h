@@ -50,6 +50,155 @@
 #define UVFS_IOCTL_STATUS 43
 #define UVFS_IOCTL_USE_COUNT 44
 #define UVFS_IOCTL_MOUNT 45
+#define UVFS_IOCTL_SHARDS 46
+#define UVFS_IOCTL_BIND_SHARD 47
+#define UVFS_IOCTL_FEATURES 48
+#define UVFS_IOCTL_RING_SETUP 49
+#define UVFS_IOCTL_RING_ENTER 50
+#define UVFS_IOCTL_CHANNEL 51
+#define UVFS_IOCTL_SNAPSHOT 52
+#define UVFS_IOCTL_HELLO 53
+
+/*
+ * Each mount sends its requests down the channel given by its channel=
+ * mount option, 0 by default.  A daemon fd serves channel 0 until it
+ * selects another with UVFS_IOCTL_CHANNEL, which must happen before the
+ * fd reads requests or sets up rings.  The other ioctls act on the
+ * channel of the fd they are issued on.
+ */
+#define UVFS_MAX_CHANNELS 16
+
+/*
+ * Optional protocol features, enabled per fd with UVFS_IOCTL_FEATURES
+ * or UVFS_IOCTL_HELLO.  Both return the subset of the requested bits the
+ * module supports.  Features that change request layouts can only be
+ * enabled with UVFS_IOCTL_HELLO.
+ */
+#define UVFS_FEATURE_BATCH_READ 0x00000001  /* several requests per read */
+#define UVFS_FEATURE_BATCH_WRITE 0x00000002 /* several replies per write */
+#define UVFS_FEATURE_CANCEL 0x00000004      /* UVFS_CANCEL requests */
+#define UVFS_FEATURE_COMPACT 0x00000008     /* compact SYMLINK and RENAME,
+                                               UVFS_IOCTL_HELLO only */
+#define UVFS_FEATURE_COMPOUND 0x00000010    /* UVFS_COMPOUND requests,
+                                               UVFS_IOCTL_HELLO only */
+
+/*
+ * A daemon opens the conversation on a new fd with UVFS_IOCTL_HELLO,
+ * passing the newest protocol version it speaks, the features it wants
+ * and the most data it handles in one read, write and readdir, 0 for
+ * no limit.  The module returns the version both speak, the features
+ * enabled on the fd and the limits in force on the channel, which are
+ * the smallest of those of the module and every daemon fd that said
+ * hello.  Features that change request layouts are only used if every
+ * daemon fd of the channel that said hello enabled them.
+ *
+ * Daemons that never say hello get version 1, the features they set
+ * with UVFS_IOCTL_FEATURES and the limits of the fixed layouts below.
+ */
+#define UVFS_PROTOCOL_VERSION 2
+
+typedef struct _uvfs_hello_s
+{
+    unsigned version;       /* in: daemon's newest, out: agreed */
+    unsigned features;      /* in: wanted, out: enabled on this fd */
+    unsigned max_read;      /* bytes of data in a READ reply */
+    unsigned max_write;     /* bytes of data in a WRITE request */
+    unsigned max_readdir;   /* bytes of data in a READDIR reply */
+} uvfs_hello_s;
+
+/*
+ * Batched messages are packed back to back, each one starting at the
+ * aligned end of the one before it.
+ */
+#define UVFS_BATCH_ALIGN(size) (((size) + 3) & ~3)
+#define UVFS_MAX_BATCH 32
+
+/*
+ * Shared memory rings.  UVFS_IOCTL_RING_SETUP takes a uvfs_ring_setup_s,
+ * after which the daemon mmaps mmap_size bytes of the same fd.  The
+ * mapping holds a uvfs_ring_hdr_s at offset 0, the request (submission)
+ * slots at sq_offset and the reply (completion) slots at cq_offset.
+ * Each slot holds one request or reply, in the same format as read()
+ * and write().  Indexes run freely; slot i is at (i & (entries - 1)).
+ *
+ * The module posts requests and advances sq_tail; the daemon consumes
+ * them and advances sq_head.  The daemon posts replies and advances
+ * cq_tail; the module consumes them and advances cq_head.
+ *
+ * UVFS_IOCTL_RING_ENTER consumes posted replies, refills the request
+ * ring from the queue and, with UVFS_RING_ENTER_WAIT, sleeps while there
+ * is nothing to do.  It returns the number of requests in the ring.
+ * Doorbells are only needed on the empty to non-empty transition: the
+ * module wakes a waiting daemon when it posts to an empty request ring,
+ * and the daemon only has to enter when it posts to an empty reply ring.
+ */
+#define UVFS_RING_MAX_ENTRIES 256
+#define UVFS_RING_ENTER_WAIT 1
+
+typedef struct _uvfs_ring_setup_s
+{
+    unsigned entries;       /* in: slots per ring, a power of 2 */
+    unsigned slot_size;     /* in: bytes per slot, out: as rounded up */
+    unsigned sq_offset;     /* out */
+    unsigned cq_offset;     /* out */
+    unsigned mmap_size;     /* out */
+} uvfs_ring_setup_s;
+
+typedef struct _uvfs_ring_hdr_s
+{
+    unsigned sq_head;
+    unsigned sq_tail;
+    unsigned cq_head;
+    unsigned cq_tail;
+} uvfs_ring_hdr_s;
+
+/*
+ * UVFS_IOCTL_SNAPSHOT fills in a uvfs_snapshot_s for the channel of the
+ * fd.  The caller sets size to the bytes it has room for; the module
+ * fills in at most that much and sets size and nr_ops to what it did.
+ * New fields go in before ops, so ops moves: tools find it at
+ * ops_offset bytes into the snapshot, never by the field, and keep
+ * working against modules with fewer or more fields and request types.
+ * Queued requests wait for a daemon thread, in flight ones have been
+ * taken by the daemon and wait for the reply.  Ages are in ms.
+ * low_serial and high_serial bound the serials of pending requests,
+ * both -1 if nothing is pending.  The counts are gathered one lock at
+ * a time, so they need not add up exactly on a busy channel.
+ */
+#define UVFS_SNAPSHOT_OPS 19        /* request types 0 to UVFS_COMPOUND */
+#define UVFS_SNAPSHOT_PRIOS 3       /* metadata, data, background */
+
+typedef struct _uvfs_snapshot_op_s
+{
+    unsigned queued;
+    unsigned in_flight;
+    unsigned oldest_queued_ms;
+    unsigned oldest_in_flight_ms;
+} uvfs_snapshot_op_s;
+
+typedef struct _uvfs_snapshot_s
+{
+    unsigned size;                  /* in: room at arg, out: bytes filled */
+    unsigned nr_ops;                /* entries of ops filled in */
+    unsigned ops_offset;            /* where ops starts in the snapshot */
+    int channel;
+    int fds;                        /* daemon fds serving this channel */
+    int mounts;
+    int shards;
+    int shutting_down;
+    int stalled;                    /* the watchdog gave up on the daemon */
+    int next_serial;
+    int low_serial;
+    int high_serial;
+    unsigned queued;
+    unsigned in_flight;
+    unsigned coalesced;
+    unsigned prio_queued[UVFS_SNAPSHOT_PRIOS];
+    unsigned prio_wait_count[UVFS_SNAPSHOT_PRIOS];
+    unsigned prio_wait_avg_ms[UVFS_SNAPSHOT_PRIOS];
+    unsigned prio_wait_max_ms[UVFS_SNAPSHOT_PRIOS];
+    uvfs_snapshot_op_s ops[UVFS_SNAPSHOT_OPS];
+} uvfs_snapshot_s;
 
 #define byte_t  char
 #define uint4_t unsigned int
@@ -117,6 +266,12 @@ typedef struct _uvfs_generic_req_s
 
 #define UVFS_WRITE 1
 
+/*
+ * buff holds count bytes.  Once UVFS_IOCTL_HELLO agreed on a max_write
+ * larger than a page, writeback may send up to max_write bytes in one
+ * request, so the daemon has to read requests, and size ring slots,
+ * with room for that much data after the header.
+ */
 typedef struct _uvfs_file_write_req_s
 {
     int type;
@@ -203,6 +358,23 @@ typedef struct _uvfs_symlink_req_s
     int symlen;
 } uvfs_symlink_req_s;
 
+/*
+ * With UVFS_FEATURE_COMPACT the name and the path follow each other at
+ * the end, and size only covers the bytes used.
+ */
+typedef struct _uvfs_symlink_compact_req_s
+{
+    int type;
+    int serial;
+    int size;
+    unsigned uid;
+    unsigned gid;
+    uvfs_fhandle_s fh;
+    unsigned namelen;
+    unsigned symlen;
+    char data[UVFS_MAX_NAMELEN + UVFS_MAX_PATHLEN];  /* name, then sympath */
+} uvfs_symlink_compact_req_s;
+
 #define UVFS_MKDIR 7
 
 typedef struct _uvfs_mkdir_req_s
@@ -249,6 +421,21 @@ typedef struct _uvfs_rename_req_s
     int new_namelen;
 } uvfs_rename_req_s;
 
+/* The UVFS_FEATURE_COMPACT layout, names at the end as for symlinks */
+typedef struct _uvfs_rename_compact_req_s
+{
+    int type;
+    int serial;
+    int size;
+    unsigned uid;
+    unsigned gid;
+    uvfs_fhandle_s fh_old;
+    uvfs_fhandle_s fh_new;
+    unsigned old_namelen;
+    unsigned new_namelen;
+    char data[2 * UVFS_MAX_NAMELEN];    /* old_name, then new_name */
+} uvfs_rename_compact_req_s;
+
 #define UVFS_READDIR 10
 
 typedef struct _uvfs_readdir_req_s
@@ -339,6 +526,54 @@ typedef struct _uvfs_shutdown_req_s
     int size;
 } uvfs_shutdown_req_s;
 
+#define UVFS_CANCEL 17
+
+/*
+ * The caller of request cancel_serial gave up waiting for it.  Only sent
+ * to channels where UVFS_FEATURE_CANCEL is enabled, and never answered;
+ * a late reply to cancel_serial is refused like any unknown serial.
+ */
+typedef struct _uvfs_cancel_req_s
+{
+    int type;
+    int serial;
+    int size;
+    int cancel_serial;
+} uvfs_cancel_req_s;
+
+#define UVFS_COMPOUND 18
+
+/*
+ * Several requests in one round trip.  data holds count sub-requests,
+ * each a uvfs_compound_op_s followed by a complete request, packed like
+ * batched requests.  The daemon runs them in order and stops after the
+ * first one that fails.  A sub-request with UVFS_COMPOUND_PREV_FH works
+ * on the fh in the reply to the one before it, such as the file a
+ * CREATE made, instead of its own.
+ *
+ * The reply carries the replies to the sub-requests that ran, packed
+ * the same way, and count says how many there are.  Each has its own
+ * error; the error of the compound reply is only set if none ran.  Only
+ * sent to channels where UVFS_FEATURE_COMPOUND is enabled.
+ */
+#define UVFS_COMPOUND_MAX 4
+#define UVFS_COMPOUND_SIZE 2048
+#define UVFS_COMPOUND_PREV_FH 0x00000001
+
+typedef struct _uvfs_compound_op_s
+{
+    unsigned flags;         /* UVFS_COMPOUND_* */
+} uvfs_compound_op_s;
+
+typedef struct _uvfs_compound_req_s
+{
+    int type;
+    int serial;
+    int size;
+    unsigned count;
+    char data[UVFS_COMPOUND_SIZE];
+} uvfs_compound_req_s;
+
 typedef union _uvfs_request_u
 {
     uvfs_generic_req_s generic;
@@ -348,9 +583,11 @@ typedef union _uvfs_request_u
     uvfs_lookup_req_s lookup;
     uvfs_unlink_req_s unlink;
     uvfs_symlink_req_s symlink;
+    uvfs_symlink_compact_req_s symlink_compact;
     uvfs_mkdir_req_s mkdir;
     uvfs_rmdir_req_s rmdir;
     uvfs_rename_req_s rename;
+    uvfs_rename_compact_req_s rename_compact;
     uvfs_readdir_req_s readdir;
     uvfs_setattr_req_s setattr;
     uvfs_getattr_req_s getattr;
@@ -358,6 +595,8 @@ typedef union _uvfs_request_u
     uvfs_read_super_req_s read_super;
     uvfs_readlink_req_s readlink;
     uvfs_shutdown_req_s shutdown;
+    uvfs_cancel_req_s cancel;
+    uvfs_compound_req_s compound;
 } uvfs_request_u;
 
 
@@ -382,6 +621,11 @@ typedef struct _uvfs_file_write_rep_s
 } uvfs_file_write_rep_s;
 
 
+/*
+ * buff holds bytes_read bytes.  Once UVFS_IOCTL_HELLO agreed on a
+ * max_read larger than a page, a READ may ask for up to max_read bytes
+ * and buff extends as far as its reply needs.
+ */
 typedef struct _uvfs_file_read_rep_s
 {
     int type;
@@ -553,6 +797,17 @@ typedef struct _uvfs_shutdown_rep_s
 } uvfs_shutdown_rep_s;
 
 
+typedef struct _uvfs_compound_rep_s
+{
+    int type;
+    int serial;
+    int size;
+    int error;
+    unsigned count;
+    char data[UVFS_COMPOUND_SIZE];
+} uvfs_compound_rep_s;
+
+
 typedef union _uvfs_reply_u
 {
     uvfs_generic_rep_s generic;
@@ -572,6 +827,7 @@ typedef union _uvfs_reply_u
     uvfs_read_super_rep_s read_super;
     uvfs_readlink_rep_s readlink;
     uvfs_shutdown_rep_s shutdown;
+    uvfs_compound_rep_s compound;
 } uvfs_reply_u;
 
 #endif /* !_UVFS_PROTOCOL_H_ */
@@ -0,0 +1,209 @@
+/*
+ *   stats.c -- request latency statistics
+ *
+ *   Copyright (C) 2002      Britt Park
+ *   Copyright (C) 2004-2012 Interwoven, Inc.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <asm/div64.h>
+#include "uvfs.h"
+
+/*
+ * Each answered request adds the time it spent in three phases to a
+ * log2 histogram of its op type: queue wait (queued until a daemon
+ * thread picked it up), service (picked up until the reply came in)
+ * and wakeup (reply until the caller ran again).  Bucket b counts times
+ * below 2^b microseconds.  Counters are per cpu so recording takes no
+ * locks; /proc/fs/pmfs_stats adds them up.
+ */
+#define UVFS_STATS_NAME "fs/pmfs_stats"
+#define UVFS_NR_OPS (UVFS_COMPOUND + 1)
+#define UVFS_HIST_BUCKETS 28
+
+#define UVFS_PHASE_QUEUE 0
+#define UVFS_PHASE_SERVICE 1
+#define UVFS_PHASE_WAKEUP 2
+#define UVFS_NR_PHASES 3
+
+static char* Phase_names[] =
+{
+    "queue",
+    "service",
+    "wakeup",
+};
+
+typedef struct _uvfs_cpu_stats_s
+{
+    unsigned long hist[UVFS_NR_OPS][UVFS_NR_PHASES][UVFS_HIST_BUCKETS];
+} uvfs_cpu_stats_s;
+
+static uvfs_cpu_stats_s* Uvfs_stats;
+static struct proc_dir_entry* uvfs_stats_file;
+
+
+static inline int uvfs_hist_bucket(u64 start, u64 end)
+{
+    u64 us;
+
+    if (end <= start)
+        return 0;
+    us = end - start;
+    do_div(us, 1000);
+    if (us >= (1UL << (UVFS_HIST_BUCKETS - 1)))
+        return UVFS_HIST_BUCKETS - 1;
+    return fls((unsigned)us);
+}
+
+
+/*
+ * Called by the caller of trans once it has run again after the reply.
+ * Requests that never reached the daemon, or got no reply, are skipped.
+ */
+void uvfs_stats_record(int type, uvfs_transaction_s* trans)
+{
+    uvfs_cpu_stats_s* stats;
+    u64 now;
+
+    if (Uvfs_stats == NULL || type <= 0 || type >= UVFS_NR_OPS ||
+        trans->t_dequeued == 0 || trans->t_replied == 0)
+    {
+        return;
+    }
+    now = uvfs_clock();
+    stats = per_cpu_ptr(Uvfs_stats, get_cpu());
+    stats->hist[type][UVFS_PHASE_QUEUE]
+        [uvfs_hist_bucket(trans->t_queued, trans->t_dequeued)]++;
+    stats->hist[type][UVFS_PHASE_SERVICE]
+        [uvfs_hist_bucket(trans->t_dequeued, trans->t_replied)]++;
+    stats->hist[type][UVFS_PHASE_WAKEUP]
+        [uvfs_hist_bucket(trans->t_replied, now)]++;
+    put_cpu();
+}
+
+
+/* Upper bound in microseconds of the bucket holding the pct percentile. */
+
+static unsigned long uvfs_hist_percentile(unsigned long* hist,
+                                          unsigned long count,
+                                          int pct)
+{
+    unsigned long want = (count * pct + 99) / 100;
+    unsigned long seen = 0;
+    int b;
+
+    for (b = 0; b < UVFS_HIST_BUCKETS; b++)
+    {
+        seen += hist[b];
+        if (seen >= want)
+            break;
+    }
+    return 1UL << min(b, UVFS_HIST_BUCKETS - 1);
+}
+
+
+static int uvfs_stats_show(struct seq_file* m, void* v)
+{
+    unsigned long hist[UVFS_NR_PHASES][UVFS_HIST_BUCKETS];
+    unsigned long count;
+    int op, phase, cpu, b;
+
+    seq_printf(m, "%-10s %-8s %10s %10s %10s %10s  %s\n",
+               "op", "phase", "count", "p50_us", "p99_us", "max_us",
+               "histogram (below_us:count)");
+    for (op = 1; op < UVFS_NR_OPS; op++)
+    {
+        memset(hist, 0, sizeof(hist));
+        for_each_possible_cpu(cpu)
+        {
+            uvfs_cpu_stats_s* stats = per_cpu_ptr(Uvfs_stats, cpu);
+            for (phase = 0; phase < UVFS_NR_PHASES; phase++)
+            {
+                for (b = 0; b < UVFS_HIST_BUCKETS; b++)
+                    hist[phase][b] += stats->hist[op][phase][b];
+            }
+        }
+        count = 0;
+        for (b = 0; b < UVFS_HIST_BUCKETS; b++)
+            count += hist[UVFS_PHASE_QUEUE][b];
+        if (count == 0)
+            continue;
+        for (phase = 0; phase < UVFS_NR_PHASES; phase++)
+        {
+            int top = 0;
+            for (b = 0; b < UVFS_HIST_BUCKETS; b++)
+            {
+                if (hist[phase][b])
+                    top = b;
+            }
+            seq_printf(m, "%-10s %-8s %10lu %10lu %10lu %10lu ",
+                       Op_names[op], Phase_names[phase], count,
+                       uvfs_hist_percentile(hist[phase], count, 50),
+                       uvfs_hist_percentile(hist[phase], count, 99),
+                       1UL << top);
+            for (b = 0; b <= top; b++)
+            {
+                if (hist[phase][b])
+                    seq_printf(m, " %lu:%lu", 1UL << b, hist[phase][b]);
+            }
+            seq_putc(m, '\n');
+        }
+    }
+    return 0;
+}
+
+
+static int uvfs_stats_open(struct inode* inode, struct file* file)
+{
+    return single_open(file, uvfs_stats_show, NULL);
+}
+
+
+static struct file_operations Uvfs_stats_operations =
+{
+    .open           = uvfs_stats_open,
+    .read           = seq_read,
+    .llseek         = seq_lseek,
+    .release        = single_release,
+};
+
+
+int uvfs_init_stats(void)
+{
+    Uvfs_stats = alloc_percpu(uvfs_cpu_stats_s);
+    if (Uvfs_stats == NULL)
+        return -ENOMEM;
+    uvfs_stats_file = create_proc_entry(UVFS_STATS_NAME, S_IFREG | 0444, NULL);
+    if (uvfs_stats_file == NULL)
+    {
+        free_percpu(Uvfs_stats);
+        Uvfs_stats = NULL;
+        return -EIO;
+    }
+    uvfs_stats_file->proc_fops = &Uvfs_stats_operations;
+    return 0;
+}
+
+
+void uvfs_destroy_stats(void)
+{
+    remove_proc_entry(UVFS_STATS_NAME, NULL);
+    free_percpu(Uvfs_stats);
+    Uvfs_stats = NULL;
+}
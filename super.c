@@ -54,6 +54,7 @@ static void init_once(void *foo)
 {
     struct uvfs_inode_info *uvfsi = foo;
 
+    atomic_set(&uvfsi->writeback, 0);
     inode_init_once(&uvfsi->vfs_inode);
 }
 
@@ -98,6 +99,7 @@ static void init_once(void *foo, kmem_cache_t *cachep, unsigned long flags)
     if ((flags & (SLAB_CTOR_VERIFY|SLAB_CTOR_CONSTRUCTOR)) ==
         SLAB_CTOR_CONSTRUCTOR)
     {
+        atomic_set(&uvfsi->writeback, 0);
         inode_init_once(&uvfsi->vfs_inode);
     }
 }
@@ -184,6 +186,9 @@ uvfs_iget(struct super_block *sb, uvfs_fhandle_s *fh, uvfs_attr_s *fattr)
             inode->i_op = &Uvfs_file_inode_operations;
             inode->i_fop = &Uvfs_file_file_operations;
             inode->i_data.a_ops = &Uvfs_file_aops;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+            inode->i_data.backing_dev_info = &UVFS_SB(sb)->bdi;
+#endif
         }
         else if (S_ISDIR(inode->i_mode))
         {
@@ -213,9 +218,13 @@ uvfs_iget(struct super_block *sb, uvfs_fhandle_s *fh, uvfs_attr_s *fattr)
 
 int uvfs_refresh_inode(struct inode *inode, uvfs_attr_s *fattr)
 {
-    if (inode->i_size != fattr->i_size ||
-        inode->i_mtime.tv_sec != fattr->i_mtime.tv_sec ||
-        inode->i_mtime.tv_nsec != fattr->i_mtime.tv_nsec)
+    int cached = uvfs_cached_writes(inode);
+
+    /* pages the daemon hasn't seen yet are newer than its attributes */
+    if (!cached &&
+        (inode->i_size != fattr->i_size ||
+         inode->i_mtime.tv_sec != fattr->i_mtime.tv_sec ||
+         inode->i_mtime.tv_nsec != fattr->i_mtime.tv_nsec))
     {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
         invalidate_inode_pages2(inode->i_mapping);
@@ -228,7 +237,8 @@ int uvfs_refresh_inode(struct inode *inode, uvfs_attr_s *fattr)
     inode->i_nlink = fattr->i_nlink;
     inode->i_uid = fattr->i_uid;
     inode->i_gid = fattr->i_gid;
-    inode->i_size = fattr->i_size;
+    if (!cached || fattr->i_size > inode->i_size)
+        inode->i_size = fattr->i_size;
     inode->i_atime.tv_sec = fattr->i_atime.tv_sec;
     inode->i_atime.tv_nsec = fattr->i_atime.tv_nsec;
     inode->i_mtime.tv_sec = fattr->i_mtime.tv_sec;
@@ -255,7 +265,7 @@ int uvfs_revalidate_inode(struct inode *inode)
 
     dprintk("<1>Entering uvfs_revalidate_inode\n");
 
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(inode->i_sb, UVFS_GETATTR);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -277,7 +287,7 @@ int uvfs_revalidate_inode(struct inode *inode)
         uvfs_refresh_inode(inode, &reply->a);
     }
 
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exiting uvfs_revalidate_inode\n");
     return error;
 }
@@ -452,7 +462,7 @@ struct dentry* uvfs_get_dentry(struct super_block *sb, void *inump)
         dprintk("uvfs_get_dentry: ilookup5 failed, hash = %lu\n", hash);
         debugDisplayFhandle("uvfs_get_dentry: fh is: ", fh);
 
-        trans = uvfs_new_transaction();
+        trans = uvfs_new_transaction(sb, UVFS_GETATTR);
         if (trans == NULL)
         {
             return ERR_PTR(-ENOMEM);
@@ -491,7 +501,7 @@ struct dentry* uvfs_get_dentry(struct super_block *sb, void *inump)
             }
         }
 
-        kfree(trans);
+        uvfs_free_transaction(trans);
     }
 
     if (inode)
@@ -533,10 +543,11 @@ int uvfs_statfs(struct super_block* sb, struct kstatfs* stat)
     uvfs_transaction_s* trans;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
     struct inode *inode = dentry->d_inode;
+    struct super_block *sb = inode->i_sb;
 #endif
     dprintk("<1>Entering uvfs_statfs\n");
 
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(sb, UVFS_STATFS);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -564,7 +575,7 @@ int uvfs_statfs(struct super_block* sb, struct kstatfs* stat)
     stat->f_namelen = reply->f_namelen;
     error = reply->error;
 
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exited uvfs_statfs %d\n", error);
     return error;
 }
@@ -573,9 +584,28 @@ int uvfs_statfs(struct super_block* sb, struct kstatfs* stat)
 /* format:  option1=data1,option2=data2
  * imagine future options might include timeout for iwserver,
  * cache expiration
+ * [channel=N,][writeback,]store=path, store must come last
+ *
+ * writeback keeps written data in the page cache until writeback,
+ * fsync or close sends it, instead of sending every write() at once.
  */
-static int uvfs_parse_options(struct super_block* sb, char* options, char **iwstore)
+static int uvfs_parse_options(struct super_block* sb, char* options,
+                              int *channel, int *writeback, char **iwstore)
 {
+    *channel = 0;
+    *writeback = 0;
+    if (!strncmp(options, "channel=", 8))
+    {
+        *channel = simple_strtoul(options + 8, &options, 10);
+        if (*options != ',')
+            return 1;
+        options++;
+    }
+    if (!strncmp(options, "writeback,", 10))
+    {
+        *writeback = 1;
+        options += 10;
+    }
     if (!strncmp(options, "store=", 6))
     {
         *iwstore = options + 6;
@@ -594,18 +624,56 @@ int uvfs_read_super(struct super_block* sb,
     uvfs_read_super_req_s* request;
     uvfs_read_super_rep_s* reply;
     uvfs_transaction_s* trans;
+    struct uvfs_sb_info* sbi;
     char* arg;
     size_t arglength;
+    int channel;
+    int writeback;
 
     dprintk("<1>Entering uvfs_read_super:"
            "sb = 0x%p, data = 0x%p, silent = %d\n",
            sb, data, silent);
-    if (data == 0 || uvfs_parse_options(sb, data, &arg))
+    if (data == 0 ||
+        uvfs_parse_options(sb, data, &channel, &writeback, &arg))
     {
         printk("<1>uvfs_read_super: invalid options!\n");
         return -EINVAL;
     }
 
+    /* uvfs_kill_sb undoes this, even if we fail below */
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+    if (sbi == NULL)
+    {
+        return -ENOMEM;
+    }
+    sbi->channel = uvfs_get_channel(channel);
+    if (sbi->channel == NULL)
+    {
+        printk("<1>uvfs_read_super: invalid channel %d\n", channel);
+        kfree(sbi);
+        return -EINVAL;
+    }
+    sb->s_fs_info = sbi;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+    /* our own bdi, so sync and the flusher threads find our dirty pages */
+    sbi->writeback = writeback;
+    sbi->bdi.name = UVFS_MODULE_NAME;
+    sbi->bdi.ra_pages = VM_MAX_READAHEAD * 1024 / PAGE_CACHE_SIZE;
+    retval = bdi_init(&sbi->bdi);
+    if (retval)
+        return retval;
+    sbi->bdi_init = 1;
+    retval = bdi_register(&sbi->bdi, NULL, "pmfs-%u:%u",
+                          MAJOR(sb->s_dev), MINOR(sb->s_dev));
+    if (retval)
+        return retval;
+    sb->s_bdi = &sbi->bdi;
+#else
+    if (writeback)
+        printk("<1>uvfs_read_super: writeback needs 2.6.32, ignored\n");
+#endif
+
     arglength = strlen(arg) + 1;
     if (arglength >= UVFS_MAX_PATHLEN)
     {
@@ -613,7 +681,7 @@ int uvfs_read_super(struct super_block* sb,
         return -ENAMETOOLONG;
     }
     dprintk("<1>uvfs_read_super uvfs_new_transaction\n");
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(sb, UVFS_READ_SUPER);
     if (trans == NULL)
     {
         dprintk("<1>Exited uvfs_read_super\n");
@@ -657,11 +725,28 @@ int uvfs_read_super(struct super_block* sb,
     retval = 0;
 
 out:
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exited uvfs_read_super %d\n", retval);
     return retval;
 }
 
+/* Called at unmount, and when uvfs_read_super fails. */
+void uvfs_kill_sb(struct super_block* sb)
+{
+    struct uvfs_sb_info* sbi = UVFS_SB(sb);
+
+    kill_anon_super(sb);
+    if (sbi != NULL)
+    {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+        if (sbi->bdi_init)
+            bdi_destroy(&sbi->bdi);
+#endif
+        uvfs_put_channel(sbi->channel);
+        kfree(sbi);
+    }
+}
+
 /*
  * super block wrapper function used by Linux 2.6.x kernels
  */
@@ -29,7 +29,7 @@ int uvfs_readlink(struct dentry *dentry, char *buffer, int buflen)
     uvfs_transaction_s* trans;
     struct inode* inode = dentry->d_inode;
     dprintk("<1>Entering uvfs_readlink name=%s\n", dentry->d_name.name);
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(inode->i_sb, UVFS_READLINK);
     if (trans == NULL)
     {
         return -ENOMEM;
@@ -52,7 +52,7 @@ int uvfs_readlink(struct dentry *dentry, char *buffer, int buflen)
     reply->buff[reply->len] = 0;
     error = vfs_readlink(dentry, buffer, buflen, reply->buff);
 out:
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exited uvfs_readlink error=%d\n", error);
     return error;
 }
@@ -69,7 +69,7 @@ int uvfs_follow_link(struct dentry *dentry, struct nameidata *nd)
     uvfs_transaction_s* trans;
     struct inode* inode = dentry->d_inode;
     dprintk("<1>Entering uvfs_follow_link name=%s\n", dentry->d_name.name);
-    trans = uvfs_new_transaction();
+    trans = uvfs_new_transaction(inode->i_sb, UVFS_READLINK);
     if (trans == NULL)
     {
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
@@ -96,7 +96,7 @@ int uvfs_follow_link(struct dentry *dentry, struct nameidata *nd)
     reply->buff[reply->len] = 0;
     error = vfs_follow_link(nd, reply->buff);
 out:
-    kfree(trans);
+    uvfs_free_transaction(trans);
     dprintk("<1>Exited uvfs_follow_link error=%d\n", error);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
     return ERR_PTR(error);
@@ -25,10 +25,13 @@
 #include <linux/fs.h>
 #include <linux/mm.h>
 #include <linux/sched.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 #include <linux/version.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
 #include <linux/cred.h>
 #include <linux/exportfs.h>
+#include <linux/backing-dev.h>
 #endif
 #include "protocol.h"
 
@@ -46,6 +49,7 @@ struct uvfs_inode_info
 {
     struct _uvfs_fhandle_s fh;
     uid_t attr_uid;
+    atomic_t writeback;             /* pages under writeback for a WRITE */
     struct inode vfs_inode;
 };
 
@@ -54,21 +58,107 @@ static inline struct uvfs_inode_info *UVFS_I(struct inode *inode)
     return container_of(inode, struct uvfs_inode_info, vfs_inode);
 }
 
+/* a request channel to one daemon, private to driver.c */
+typedef struct _uvfs_channel_s uvfs_channel_s;
+
+struct uvfs_sb_info
+{
+    uvfs_channel_s* channel;        /* requests for this mount go here */
+    int writeback;                  /* writes stay in the page cache */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
+    int bdi_init;                   /* bdi needs bdi_destroy */
+    struct backing_dev_info bdi;    /* dirty page accounting and flusher */
+#endif
+};
+
+static inline struct uvfs_sb_info *UVFS_SB(struct super_block *sb)
+{
+    return sb->s_fs_info;
+}
+
+/*
+ * In write-back mode, true while the page cache holds data of inode the
+ * daemon has not acknowledged.  Until then our size and pages are newer
+ * than the daemon's.
+ */
+static inline int uvfs_cached_writes(struct inode *inode)
+{
+    return UVFS_SB(inode->i_sb)->writeback &&
+           (mapping_tagged(inode->i_mapping, PAGECACHE_TAG_DIRTY) ||
+            mapping_tagged(inode->i_mapping, PAGECACHE_TAG_WRITEBACK));
+}
+
+/*
+ * Priority classes of queued requests, highest first.  Requests of a
+ * lower class are served first once they have waited prio_age_ms.
+ */
+#define UVFS_PRIO_META 0            /* interactive metadata operations */
+#define UVFS_PRIO_DATA 1            /* foreground reads and writes */
+#define UVFS_PRIO_BACKGROUND 2      /* writeback and readahead */
+#define UVFS_NR_PRIOS 3
+
+/* most pages one READ fills, if the daemon's max_read allows */
+#define UVFS_MAX_READ_PAGES 32
+
+/* most pages one WRITE from writeback carries, if max_write allows */
+#define UVFS_MAX_WRITE_PAGES 32
+
+/*
+ * Transaction state bits.  They are only changed with atomic bit
+ * operations, so they can be tested without a lock.
+ */
+#define UVFS_TRANS_IN_USE   0       /* being copied to or from the daemon */
+#define UVFS_TRANS_ABORT    1       /* caller gave up, waits for !IN_USE */
+#define UVFS_TRANS_ANSWERED 2       /* the reply or an error is in place */
+#define UVFS_TRANS_RETRY    3       /* leader gave up, send our own */
+
 typedef struct _uvfs_transaction_s
 {
-    struct list_head list;
+    struct list_head list;          /* on a shard queue while queued,
+                                       or on the followers of a leader */
+    struct hlist_node hash;         /* in channel replies while in flight */
     wait_queue_head_t fs_queue;
+    uvfs_channel_s* channel;        /* channel of the mount it is for */
+    int serial;
+    int shard;                      /* request shard it was queued on */
+    int prio;                       /* UVFS_PRIO_*, set before queueing */
+    unsigned long queued;           /* jiffies when queued */
+    /* uvfs_clock() times for the latency statistics, 0 if not reached */
+    u64 t_queued;
+    u64 t_dequeued;
+    u64 t_replied;
+    unsigned long state;            /* UVFS_TRANS_* bits */
+    int noreply;                    /* a message nobody waits for */
+    /* completion of uvfs_make_request_async */
+    void (*done)(struct _uvfs_transaction_s *);
+    void* private;                  /* for the use of done */
+    unsigned long deadline;         /* jiffies an async request times out */
+    /* READ reply data goes straight from the daemon into these */
+    struct page** pages;
+    unsigned nr_pages;
+    struct page* page;              /* pages of a single page READ */
+    struct work_struct work;
+    /* coalescing of identical requests */
+    struct hlist_node coalesce;     /* in channel leaders while sent */
+    struct list_head followers;     /* requests waiting on our reply */
+    struct _uvfs_transaction_s* leader; /* the request we wait on */
+    u32 key;
+    int type;                       /* request type it was allocated for */
+    int capacity;                   /* bytes allocated for u */
+    /* must be last, only capacity bytes of it are allocated */
     union
     {
         uvfs_request_u request;
         uvfs_reply_u reply;
     } u;
-    int serial;
-    int in_use;
-    int abort;
-    int answered;
 } uvfs_transaction_s;
 
+/* nanoseconds, for timing requests */
+static inline u64 uvfs_clock(void)
+{
+    return ktime_to_ns(ktime_get());
+}
+
 #ifdef DEBUG_PRINT
 #define dprintk printk
 #define debugDisplayFhandle displayFhandle
@@ -97,11 +187,30 @@ extern int uvfs_permission(struct inode *, int, struct nameidata *);
 
 /* uvfs/driver.c */
 extern int uvfs_make_request(uvfs_transaction_s *);
-extern uvfs_transaction_s* uvfs_new_transaction(void);
+extern void uvfs_make_request_async(uvfs_transaction_s *,
+                                    void (*)(uvfs_transaction_s *));
+extern uvfs_transaction_s* uvfs_new_transaction(struct super_block *, int);
+extern uvfs_transaction_s* uvfs_new_transaction_size(struct super_block *,
+                                                     int, unsigned);
+extern void uvfs_free_transaction(uvfs_transaction_s *);
+extern uvfs_channel_s* uvfs_get_channel(int);
+extern void uvfs_put_channel(uvfs_channel_s *);
+extern unsigned uvfs_max_read(uvfs_channel_s *);
+extern unsigned uvfs_max_write(uvfs_channel_s *);
+extern unsigned uvfs_channel_features(uvfs_channel_s *);
+extern void* uvfs_compound_add(uvfs_transaction_s *, int, int, unsigned);
+extern void* uvfs_compound_reply(uvfs_transaction_s *, unsigned);
+extern char* Op_names[];
 
 /* uvfs/file.c */
 extern int uvfs_writepage(struct page *, struct writeback_control *);
 extern int uvfs_readpage(struct file *, struct page *);
+extern int uvfs_readpages(struct file *, struct address_space *,
+                          struct list_head *, unsigned);
+extern int uvfs_writepages(struct address_space *,
+                           struct writeback_control *);
+extern ssize_t uvfs_direct_IO(int, struct kiocb *, const struct iovec *,
+                              loff_t, unsigned long);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,32)
 extern int uvfs_write_begin(struct file *, struct address_space *, loff_t,
                             unsigned, unsigned, struct page **, void **);
@@ -115,6 +224,7 @@ extern int uvfs_getattr(struct vfsmount *, struct dentry *, struct kstat *);
 extern ssize_t uvfs_file_write(struct file *, const char *, size_t, loff_t *);
 extern ssize_t uvfs_file_read(struct file *, char *, size_t, loff_t *);
 extern int uvfs_file_mmap(struct file *, struct vm_area_struct *);
+extern int uvfs_file_flush(struct file *, fl_owner_t);
 
 /* uvfs/operations.c */
 extern struct file_operations Uvfs_file_file_operations;
@@ -128,6 +238,11 @@ extern struct super_operations Uvfs_super_operations;
 extern struct file_system_type Uvfs_file_system_type;
 extern struct export_operations Uvfs_export_operations;
 
+/* uvfs/stats.c */
+extern void uvfs_stats_record(int, uvfs_transaction_s *);
+extern int uvfs_init_stats(void);
+extern void uvfs_destroy_stats(void);
+
 /* uvfs/super.c */
 extern void displayFhandle(const char *, uvfs_fhandle_s *);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18)
@@ -138,6 +253,7 @@ extern int uvfs_statfs(struct super_block *, struct kstatfs *);
 extern struct super_block *uvfs_get_sb(struct file_system_type *, int, const char *, void *);
 #endif
 extern int uvfs_read_super(struct super_block *, void *, int);
+extern void uvfs_kill_sb(struct super_block *);
 extern int uvfs_init_inodecache(void);
 extern void uvfs_destroy_inodecache(void);
 extern struct inode *uvfs_alloc_inode(struct super_block *);
@@ -11,19 +11,107 @@
 #include <unistd.h>
 #include "protocol.h"
 
+static const char* op_names[UVFS_SNAPSHOT_OPS] =
+{
+    "null", "write", "read", "create", "lookup", "unlink", "symlink",
+    "mkdir", "rmdir", "rename", "readdir", "setattr", "getattr",
+    "statfs", "read_super", "readlink", "shutdown", "cancel", "compound"
+};
+
+static const char* prio_names[UVFS_SNAPSHOT_PRIOS] =
+{
+    "metadata", "data", "background"
+};
+
+// the module says where ops is, it moves as fields are added
+static const uvfs_snapshot_op_s* snapshot_ops(const uvfs_snapshot_s& snap)
+{
+    return (const uvfs_snapshot_op_s*)((const char*)&snap + snap.ops_offset);
+}
+
+static void print_snapshot(const uvfs_snapshot_s& snap)
+{
+    printf("channel %d: %d daemon fds, %d mounts, %d shards%s%s\n",
+           snap.channel, snap.fds, snap.mounts, snap.shards,
+           snap.shutting_down ? ", shutting down" : "",
+           snap.stalled ? ", stalled" : "");
+    printf("%u queued, %u in flight, serials %d-%d, next %d, "
+           "%u coalesced\n",
+           snap.queued, snap.in_flight, snap.low_serial, snap.high_serial,
+           snap.next_serial, snap.coalesced);
+    for (int i = 0; i < UVFS_SNAPSHOT_PRIOS; i++)
+    {
+        printf("%-10s %6u queued %10u served  wait avg %u ms max %u ms\n",
+               prio_names[i], snap.prio_queued[i], snap.prio_wait_count[i],
+               snap.prio_wait_avg_ms[i], snap.prio_wait_max_ms[i]);
+    }
+    for (int i = 0; i < (int)snap.nr_ops; i++)
+    {
+        const uvfs_snapshot_op_s& op = snapshot_ops(snap)[i];
+        if (op.queued == 0 && op.in_flight == 0)
+            continue;
+        printf("%-10s %6u queued (oldest %u ms) %6u in flight (oldest %u ms)\n",
+               op_names[i], op.queued, op.oldest_queued_ms,
+               op.in_flight, op.oldest_in_flight_ms);
+    }
+}
+
+static void print_snapshot_json(const uvfs_snapshot_s& snap)
+{
+    printf("{\"channel\":%d,\"daemon_fds\":%d,\"mounts\":%d,"
+           "\"shards\":%d,\"shutting_down\":%s,\"stalled\":%s,"
+           "\"queued\":%u,\"in_flight\":%u,\"low_serial\":%d,"
+           "\"high_serial\":%d,\"next_serial\":%d,\"coalesced\":%u,",
+           snap.channel, snap.fds, snap.mounts, snap.shards,
+           snap.shutting_down ? "true" : "false",
+           snap.stalled ? "true" : "false",
+           snap.queued, snap.in_flight, snap.low_serial, snap.high_serial,
+           snap.next_serial, snap.coalesced);
+    printf("\"priorities\":{");
+    for (int i = 0; i < UVFS_SNAPSHOT_PRIOS; i++)
+    {
+        printf("%s\"%s\":{\"queued\":%u,\"served\":%u,"
+               "\"wait_avg_ms\":%u,\"wait_max_ms\":%u}",
+               i ? "," : "", prio_names[i], snap.prio_queued[i],
+               snap.prio_wait_count[i], snap.prio_wait_avg_ms[i],
+               snap.prio_wait_max_ms[i]);
+    }
+    printf("},\"ops\":{");
+    for (int i = 1, n = 0; i < (int)snap.nr_ops; i++)
+    {
+        const uvfs_snapshot_op_s& op = snapshot_ops(snap)[i];
+        printf("%s\"%s\":{\"queued\":%u,\"in_flight\":%u,"
+               "\"oldest_queued_ms\":%u,\"oldest_in_flight_ms\":%u}",
+               n++ ? "," : "", op_names[i], op.queued, op.in_flight,
+               op.oldest_queued_ms, op.oldest_in_flight_ms);
+    }
+    printf("}}\n");
+}
+
 int main(int argc, char* argv[])
 {
     if (argc < 3)
     {
-        fprintf(stderr, "usage: %s devname command\n", argv[0]);
-        fprintf(stderr, "where command can be 'shutdown' or 'status'\n");
+        fprintf(stderr, "usage: %s devname command [channel]\n", argv[0]);
+        fprintf(stderr, "where command can be 'shutdown', 'status', 'count',\n"
+                        "'snapshot' or 'json'\n");
         return 1;
     }
     int cmd;
+    bool json = false;
     if (strcmp(argv[2], "shutdown") == 0)
     {
         cmd = UVFS_IOCTL_SHUTDOWN;
     }
+    else if (strcmp(argv[2], "snapshot") == 0)
+    {
+        cmd = UVFS_IOCTL_SNAPSHOT;
+    }
+    else if (strcmp(argv[2], "json") == 0)
+    {
+        cmd = UVFS_IOCTL_SNAPSHOT;
+        json = true;
+    }
     else if (strcmp(argv[2], "status") == 0)
     {
         cmd = UVFS_IOCTL_STATUS;
@@ -44,8 +132,20 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    // commands act on channel 0 unless told otherwise
+    if (argc > 3 && ioctl(fd, UVFS_IOCTL_CHANNEL, atoi(argv[3])) < 0)
+    {
+        fprintf(stderr,"%s ", argv[0]);
+        perror("invalid channel");
+        close(fd);
+        return 1;
+    }
+
     // execute requested command
-    int result = ioctl(fd, cmd);
+    uvfs_snapshot_s snap;
+    memset(&snap, 0, sizeof(snap));
+    snap.size = sizeof(snap);
+    int result = ioctl(fd, cmd, &snap);
     if (result < 0)
     {
         fprintf(stderr,"%s ", argv[0]);
@@ -54,7 +154,15 @@ int main(int argc, char* argv[])
         return 1;
     }
 
-    if (cmd == UVFS_IOCTL_USE_COUNT)
+    if (cmd == UVFS_IOCTL_SNAPSHOT)
+    {
+        if (json)
+            print_snapshot_json(snap);
+        else
+            print_snapshot(snap);
+        fflush(stdout);
+    }
+    else if (cmd == UVFS_IOCTL_USE_COUNT)
     {
         fprintf(stdout, "opens on this module %d\n", result);
         fflush(stdout);
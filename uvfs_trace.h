@@ -0,0 +1,314 @@
+/*
+ *   uvfs_trace.h -- tracepoints for the request lifecycle
+ *
+ *   Copyright (C) 2002      Britt Park
+ *   Copyright (C) 2004-2012 Interwoven, Inc.
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+ */
+
+/*
+ * Events under events/pmfs/ in the tracing directory, one per step of a
+ * request: allocated, queued for the daemon, picked up by a daemon
+ * thread, put back on the queue, reply matched, caller woken, and
+ * given up.  The serial ties the steps of one request together.  The
+ * reply overwrites the request, so only the queue and pick up events
+ * carry the file handle.
+ *
+ * Only driver.c includes this, with CREATE_TRACE_POINTS defined.
+ * Kernels before 2.6.32 get empty stubs.
+ */
+
+#include <linux/version.h>
+
+#ifndef _UVFS_TRACE_FH_
+#define _UVFS_TRACE_FH_
+
+/* The file handle a request is about, zeroes if it has none */
+
+static inline const uvfs_fhandle_s* uvfs_trace_fh(uvfs_transaction_s* trans)
+{
+    static const uvfs_fhandle_s none;
+    uvfs_request_u* req = &trans->u.request;
+
+    switch (trans->type)
+    {
+    case UVFS_WRITE:
+        return &req->file_write.fh;
+    case UVFS_READ:
+        return &req->file_read.fh;
+    case UVFS_CREATE:
+        return &req->create.fh;
+    case UVFS_LOOKUP:
+        return &req->lookup.fh;
+    case UVFS_UNLINK:
+        return &req->unlink.fh;
+    case UVFS_SYMLINK:
+        return &req->symlink.fh;
+    case UVFS_MKDIR:
+        return &req->mkdir.fh;
+    case UVFS_RMDIR:
+        return &req->rmdir.fh;
+    case UVFS_RENAME:
+        return &req->rename.fh_old;
+    case UVFS_READDIR:
+        return &req->readdir.fh;
+    case UVFS_SETATTR:
+        return &req->setattr.fh;
+    case UVFS_GETATTR:
+        return &req->getattr.fh;
+    case UVFS_STATFS:
+        return &req->statfs.fh;
+    case UVFS_READLINK:
+        return &req->readlink.fh;
+    default:
+        return &none;
+    }
+}
+
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,32)
+
+#ifndef _UVFS_TRACE_H_
+#define _UVFS_TRACE_H_
+
+static inline void trace_uvfs_alloc(uvfs_transaction_s* trans) {}
+static inline void trace_uvfs_enqueue(uvfs_transaction_s* trans) {}
+static inline void trace_uvfs_dequeue(uvfs_transaction_s* trans) {}
+static inline void trace_uvfs_requeue(uvfs_transaction_s* trans) {}
+static inline void trace_uvfs_reply(uvfs_transaction_s* trans, int size) {}
+static inline void trace_uvfs_wakeup(uvfs_transaction_s* trans) {}
+static inline void trace_uvfs_abort(uvfs_transaction_s* trans,
+                                    int error, int sent) {}
+
+#endif
+
+#else
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pmfs
+
+#if !defined(_UVFS_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _UVFS_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(uvfs_alloc,
+
+    TP_PROTO(uvfs_transaction_s* trans),
+
+    TP_ARGS(trans),
+
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(int, serial)
+        __field(int, type)
+        __field(int, capacity)
+    ),
+
+    TP_fast_assign(
+        __entry->channel = trans->channel->id;
+        __entry->serial = trans->serial;
+        __entry->type = trans->type;
+        __entry->capacity = trans->capacity;
+    ),
+
+    TP_printk("chan=%d serial=%d type=%d capacity=%d",
+              __entry->channel, __entry->serial, __entry->type,
+              __entry->capacity)
+);
+
+TRACE_EVENT(uvfs_enqueue,
+
+    TP_PROTO(uvfs_transaction_s* trans),
+
+    TP_ARGS(trans),
+
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(int, serial)
+        __field(int, type)
+        __field(int, size)
+        __field(int, prio)
+        __field(int, shard)
+        __field(unsigned, mntid)
+        __field(unsigned, sbxid)
+        __field(unsigned, sfuid)
+    ),
+
+    TP_fast_assign(
+        __entry->channel = trans->channel->id;
+        __entry->serial = trans->serial;
+        __entry->type = trans->type;
+        __entry->size = trans->u.request.generic.size;
+        __entry->prio = trans->prio;
+        __entry->shard = trans->shard;
+        __entry->mntid = uvfs_trace_fh(trans)->no_mntid;
+        __entry->sbxid = uvfs_trace_fh(trans)->no_sbxid;
+        __entry->sfuid = uvfs_trace_fh(trans)->no_fspid.fs_sfuid;
+    ),
+
+    TP_printk("chan=%d serial=%d type=%d size=%d prio=%d shard=%d "
+              "fh=%x:%x:%x",
+              __entry->channel, __entry->serial, __entry->type,
+              __entry->size, __entry->prio, __entry->shard,
+              __entry->mntid, __entry->sbxid, __entry->sfuid)
+);
+
+TRACE_EVENT(uvfs_dequeue,
+
+    TP_PROTO(uvfs_transaction_s* trans),
+
+    TP_ARGS(trans),
+
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(int, serial)
+        __field(int, type)
+        __field(int, size)
+        __field(u64, wait_ns)
+        __field(unsigned, mntid)
+        __field(unsigned, sbxid)
+        __field(unsigned, sfuid)
+    ),
+
+    TP_fast_assign(
+        __entry->channel = trans->channel->id;
+        __entry->serial = trans->serial;
+        __entry->type = trans->type;
+        __entry->size = trans->u.request.generic.size;
+        __entry->wait_ns = trans->t_dequeued - trans->t_queued;
+        __entry->mntid = uvfs_trace_fh(trans)->no_mntid;
+        __entry->sbxid = uvfs_trace_fh(trans)->no_sbxid;
+        __entry->sfuid = uvfs_trace_fh(trans)->no_fspid.fs_sfuid;
+    ),
+
+    TP_printk("chan=%d serial=%d type=%d size=%d wait_ns=%llu "
+              "fh=%x:%x:%x",
+              __entry->channel, __entry->serial, __entry->type,
+              __entry->size, (unsigned long long)__entry->wait_ns,
+              __entry->mntid, __entry->sbxid, __entry->sfuid)
+);
+
+TRACE_EVENT(uvfs_requeue,
+
+    TP_PROTO(uvfs_transaction_s* trans),
+
+    TP_ARGS(trans),
+
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(int, serial)
+        __field(int, type)
+    ),
+
+    TP_fast_assign(
+        __entry->channel = trans->channel->id;
+        __entry->serial = trans->serial;
+        __entry->type = trans->type;
+    ),
+
+    TP_printk("chan=%d serial=%d type=%d",
+              __entry->channel, __entry->serial, __entry->type)
+);
+
+TRACE_EVENT(uvfs_reply,
+
+    TP_PROTO(uvfs_transaction_s* trans, int size),
+
+    TP_ARGS(trans, size),
+
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(int, serial)
+        __field(int, type)
+        __field(int, size)
+    ),
+
+    TP_fast_assign(
+        __entry->channel = trans->channel->id;
+        __entry->serial = trans->serial;
+        __entry->type = trans->type;
+        __entry->size = size;
+    ),
+
+    TP_printk("chan=%d serial=%d type=%d size=%d",
+              __entry->channel, __entry->serial, __entry->type,
+              __entry->size)
+);
+
+TRACE_EVENT(uvfs_wakeup,
+
+    TP_PROTO(uvfs_transaction_s* trans),
+
+    TP_ARGS(trans),
+
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(int, serial)
+        __field(int, type)
+        __field(int, error)
+        __field(int, async)
+    ),
+
+    TP_fast_assign(
+        __entry->channel = trans->channel->id;
+        __entry->serial = trans->serial;
+        __entry->type = trans->type;
+        __entry->error = trans->u.reply.generic.error;
+        __entry->async = trans->done != NULL;
+    ),
+
+    TP_printk("chan=%d serial=%d type=%d error=%d async=%d",
+              __entry->channel, __entry->serial, __entry->type,
+              __entry->error, __entry->async)
+);
+
+TRACE_EVENT(uvfs_abort,
+
+    TP_PROTO(uvfs_transaction_s* trans, int error, int sent),
+
+    TP_ARGS(trans, error, sent),
+
+    TP_STRUCT__entry(
+        __field(int, channel)
+        __field(int, serial)
+        __field(int, type)
+        __field(int, error)
+        __field(int, sent)
+    ),
+
+    TP_fast_assign(
+        __entry->channel = trans->channel->id;
+        __entry->serial = trans->serial;
+        __entry->type = trans->type;
+        __entry->error = error;
+        __entry->sent = sent;
+    ),
+
+    TP_printk("chan=%d serial=%d type=%d error=%d sent=%d",
+              __entry->channel, __entry->serial, __entry->type,
+              __entry->error, __entry->sent)
+);
+
+#endif /* _UVFS_TRACE_H_ */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE uvfs_trace
+#include <trace/define_trace.h>
+
+#endif